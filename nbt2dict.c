@@ -1,7 +1,32 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 #include <stdint.h>
 #include <string.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||          \
+    defined(_M_IX86)
+#define NBT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define NBT_TARGET(features)
+#else
+#include <cpuid.h>
+#define NBT_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define TAG_END 0x00
 #define TAG_BYTE 0x01
@@ -18,384 +43,5029 @@
 #define TAG_LONG_ARRAY 0x0C
 #define TAG_TBD 0x0D
 
+#define NBT_MAX_DEPTH 512
+
+enum { ARRAYS_LIST, ARRAYS_MEMORYVIEW, ARRAYS_NUMPY };
+
+#define KEY_CACHE_SLOTS 1024
+#define KEY_CACHE_MAX_LENGTH 64
+
+typedef struct {
+  uint64_t hash;
+  PyObject *str;
+  uint16_t length;
+  uint8_t bytes[KEY_CACHE_MAX_LENGTH];
+} KeyCacheSlot;
+
+#if PY_VERSION_HEX < 0x030D0000
+#define dict_new_presized(size) _PyDict_NewPresized(size)
+#else
+#define dict_new_presized(size) PyDict_New()
+#endif
+
+#define SHAPE_SLOTS 256
+#define SHAPE_MAX_KEYS 32
+
+/* The ordered key set last seen for compounds starting with a given key.
+   Names point into the UTF-8 buffers of the (owned) key objects. */
+typedef struct {
+  Py_ssize_t count;
+  PyObject *keys[SHAPE_MAX_KEYS];
+  const char *names[SHAPE_MAX_KEYS];
+  Py_ssize_t lengths[SHAPE_MAX_KEYS];
+} Shape;
+
+typedef struct {
+  KeyCacheSlot keys[KEY_CACHE_SLOTS];
+  Shape shapes[SHAPE_SLOTS];
+  size_t key_hits;
+  size_t key_misses;
+  size_t shape_hits;
+  size_t shape_misses;
+} ParseCache;
+
+static ParseCache default_cache;
+
+typedef struct {
+  int array_mode;
+  int lazy;
+  int max_depth;
+  int little_endian;
+  int varint;
+  int nameless_root;
+} ParseOptions;
+
+typedef struct InflateSource InflateSource;
+typedef struct DecodeResume DecodeResume;
+
 typedef struct {
   const uint8_t *data;
   size_t pos;
   size_t length;
   int little_endian;
+  int varint;
+  int nameless_root;
+  int array_mode;
+  int max_depth;
+  /* document depth of the value decoding starts at (lazy children) */
+  int base_depth;
+  PyObject *lazy_view;
+  ParseCache *cache;
+  InflateSource *source;
+  DecodeResume *resume;
+  int starved;
 } NBTParser;
 
-static inline uint16_t swap16(uint16_t val) { return (val >> 8) | (val << 8); }
+static void parser_init(NBTParser *parser, const uint8_t *data,
+                        size_t length) {
+  parser->data = data;
+  parser->pos = 0;
+  parser->length = length;
+  parser->little_endian = 0;
+  parser->varint = 0;
+  parser->nameless_root = 0;
+  parser->array_mode = ARRAYS_LIST;
+  parser->max_depth = NBT_MAX_DEPTH;
+  parser->base_depth = 0;
+  parser->lazy_view = NULL;
+  parser->cache = &default_cache;
+  parser->source = NULL;
+  parser->resume = NULL;
+  parser->starved = 0;
+}
 
-static inline uint32_t swap32(uint32_t val) {
-  return ((val >> 24) & 0xff) | ((val << 8) & 0xff0000) |
-         ((val >> 8) & 0xff00) | ((val << 24) & 0xff000000);
+static void parser_configure(NBTParser *parser, const ParseOptions *options,
+                             ParseCache *cache) {
+  parser->array_mode = options->array_mode;
+  parser->little_endian = options->little_endian;
+  parser->varint = options->varint;
+  parser->nameless_root = options->nameless_root;
+  parser->max_depth = options->max_depth;
+  parser->cache = cache;
 }
 
-static inline uint64_t swap64(uint64_t val) {
-  return ((uint64_t)swap32((uint32_t)val) << 32) |
-         swap32((uint32_t)(val >> 32));
+static int parse_array_mode(const char *name, int *mode) {
+  if (!name || strcmp(name, "list") == 0)
+    *mode = ARRAYS_LIST;
+  else if (strcmp(name, "memoryview") == 0)
+    *mode = ARRAYS_MEMORYVIEW;
+  else if (strcmp(name, "numpy") == 0)
+    *mode = ARRAYS_NUMPY;
+  else {
+    PyErr_Format(PyExc_ValueError,
+                 "arrays must be 'list', 'memoryview' or 'numpy', not '%s'",
+                 name);
+    return -1;
+  }
+  return 0;
 }
 
-static int read_byte(NBTParser *parser, uint8_t *out) {
-  if (parser->pos >= parser->length) {
-    PyErr_SetString(PyExc_ValueError, "Unexpected end of data");
+static int parse_endian(const char *name, int *little_endian) {
+  if (!name || strcmp(name, "big") == 0)
+    *little_endian = 0;
+  else if (strcmp(name, "little") == 0)
+    *little_endian = 1;
+  else {
+    PyErr_Format(PyExc_ValueError, "endian must be 'big' or 'little', not '%s'",
+                 name);
     return -1;
   }
-  *out = parser->data[parser->pos++];
   return 0;
 }
 
-static uint16_t read_size(NBTParser *parser) {
-  if (parser->pos + 2 > parser->length) {
-    PyErr_SetString(PyExc_ValueError, "Unexpected end of data");
+/* Vectorcall argument parsing: names[0..positional) may be passed by
+   position, the rest only by keyword. out[] receives borrowed references,
+   NULL for omitted arguments. */
+static int parse_fast_args(const char *function, PyObject *const *args,
+                           Py_ssize_t nargs, PyObject *kwnames,
+                           const char *const *names, Py_ssize_t count,
+                           Py_ssize_t required, Py_ssize_t positional,
+                           PyObject **out) {
+  if (nargs > positional) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s() takes at most %zd positional arguments (%zd given)",
+                 function, positional, nargs);
     return -1;
   }
 
-  uint32_t size_le;
-  memcpy(&size_le, parser->data + parser->pos, 2);
-  parser->pos += 2;
+  for (Py_ssize_t i = 0; i < count; i++)
+    out[i] = i < nargs ? args[i] : NULL;
+
+  Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+  for (Py_ssize_t k = 0; k < nkw; k++) {
+    PyObject *name = PyTuple_GET_ITEM(kwnames, k);
+    Py_ssize_t i = 0;
+    while (i < count && PyUnicode_CompareWithASCIIString(name, names[i]))
+      i++;
+    if (i == count) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s() got an unexpected keyword argument '%U'", function,
+                   name);
+      return -1;
+    }
+    if (out[i]) {
+      PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument "
+                   "'%s'", function, names[i]);
+      return -1;
+    }
+    out[i] = args[nargs + k];
+  }
 
-  return swap16(size_le);
+  for (Py_ssize_t i = 0; i < required; i++) {
+    if (!out[i]) {
+      PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'",
+                   function, names[i]);
+      return -1;
+    }
+  }
+  return 0;
 }
 
-static int read_bytes(NBTParser *parser, void *out, size_t count) {
-  if (parser->pos + count > parser->length) {
-    PyErr_SetString(PyExc_ValueError, "Unexpected end of data");
+static int parse_str_arg(PyObject *value, const char *arg,
+                         int (*convert)(const char *, int *), int *out) {
+  if (!value)
+    return convert(NULL, out);
+  if (!PyUnicode_Check(value)) {
+    PyErr_Format(PyExc_TypeError, "%s must be a str, not %.200s", arg,
+                 Py_TYPE(value)->tp_name);
     return -1;
   }
+  const char *name = PyUnicode_AsUTF8(value);
+  return name ? convert(name, out) : -1;
+}
 
-  memcpy(out, parser->data + parser->pos, count);
-  parser->pos += count;
-  return 0;
+static int parse_arrays_arg(PyObject *value, int *mode) {
+  return parse_str_arg(value, "arrays", parse_array_mode, mode);
 }
 
-static int read_short(NBTParser *parser, int16_t *out) {
-  uint16_t val;
-  if (read_bytes(parser, &val, 2) < 0)
-    return -1;
-  if (!parser->little_endian)
-    val = swap16(val);
-  *out = (int16_t)val;
-  return 0;
+static int parse_endian_arg(PyObject *value, int *little_endian) {
+  return parse_str_arg(value, "endian", parse_endian, little_endian);
 }
 
-static int read_int(NBTParser *parser, int32_t *out) {
-  uint32_t val;
-  if (read_bytes(parser, &val, 4) < 0)
-    return -1;
-  val = swap32(val);
-  *out = (int32_t)val;
-  return 0;
+static int parse_bool_arg(PyObject *value, int *out) {
+  *out = value ? PyObject_IsTrue(value) : 0;
+  return *out < 0 ? -1 : 0;
 }
 
-static int read_long(NBTParser *parser, int64_t *out) {
-  uint64_t val;
-  if (read_bytes(parser, &val, 8) < 0)
+static int parse_depth_arg(PyObject *value, int *out) {
+  *out = NBT_MAX_DEPTH;
+  if (!value)
+    return 0;
+
+  long depth = PyLong_AsLong(value);
+  if (depth == -1 && PyErr_Occurred())
     return -1;
-  if (!parser->little_endian)
-    val = swap64(val);
-  *out = (int64_t)val;
+  if (depth < 1 || depth > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "max_depth must be a positive int");
+    return -1;
+  }
+  *out = (int)depth;
   return 0;
 }
 
-static int read_float(NBTParser *parser, float *out) {
-  uint32_t val;
-  if (read_bytes(parser, &val, 4) < 0)
+/* Network NBT is always little-endian, and lazy views are indexed by the
+   fixed-width skip engine, so varint excludes endian='big' and lazy. */
+static int check_varint(ParseOptions *options, int endian_given) {
+  if (!options->varint)
+    return 0;
+  if (endian_given && !options->little_endian) {
+    PyErr_SetString(PyExc_ValueError, "varint NBT is always little-endian");
     return -1;
-  if (!parser->little_endian)
-    val = swap32(val);
-  memcpy(out, &val, 4);
+  }
+  if (options->lazy) {
+    PyErr_SetString(PyExc_ValueError, "lazy is not supported for varint NBT");
+    return -1;
+  }
+  options->little_endian = 1;
   return 0;
 }
 
-static int read_double(NBTParser *parser, double *out) {
-  uint64_t val;
-  if (read_bytes(parser, &val, 8) < 0)
+/* The options every entry point takes, keyword-only and in this order,
+   after its own arguments: names for parse_fast_args and kwlists, and the
+   PyArg_ParseTupleAndKeywords format and targets. */
+#define OPTION_NAMES                                                           \
+  "arrays", "lazy", "max_depth", "endian", "varint", "nameless_root"
+#define OPTION_COUNT 6
+#define OPTION_FORMAT "$OOOOOO"
+#define OPTION_TARGETS(v) &(v)[0], &(v)[1], &(v)[2], &(v)[3], &(v)[4], &(v)[5]
+
+/* Options an entry point cannot honor; they are rejected, not ignored. */
+enum { NO_LAZY = 1, NO_VARINT = 2 };
+
+/* Converts the option values collected after an entry point's own
+   arguments (NULL when omitted). Tapes and the skip engine walk
+   fixed-width lengths only, hence NO_VARINT. */
+static int parse_options(const char *function, PyObject *const *values,
+                         int unsupported, ParseOptions *options) {
+  if (parse_arrays_arg(values[0], &options->array_mode) < 0 ||
+      parse_bool_arg(values[1], &options->lazy) < 0 ||
+      parse_depth_arg(values[2], &options->max_depth) < 0 ||
+      parse_endian_arg(values[3], &options->little_endian) < 0 ||
+      parse_bool_arg(values[4], &options->varint) < 0 ||
+      parse_bool_arg(values[5], &options->nameless_root) < 0)
     return -1;
-  if (!parser->little_endian)
-    val = swap64(val);
-  memcpy(out, &val, 8);
-  return 0;
+
+  if (options->lazy && (unsupported & NO_LAZY)) {
+    PyErr_Format(PyExc_ValueError, "%s does not support lazy", function);
+    return -1;
+  }
+  if (options->varint && (unsupported & NO_VARINT)) {
+    PyErr_Format(PyExc_ValueError, "%s does not support varint NBT",
+                 function);
+    return -1;
+  }
+  return check_varint(options, values[3] != NULL);
 }
 
-static PyObject *read_string(NBTParser *parser) {
-  uint16_t length = read_size(parser);
+static inline uint16_t swap16(uint16_t val) { return (val >> 8) | (val << 8); }
 
-  if (length <= 0) {
-    return PyUnicode_FromString("");
-  }
+static inline uint32_t swap32(uint32_t val) {
+  return ((val >> 24) & 0xff) | ((val << 8) & 0xff0000) |
+         ((val >> 8) & 0xff00) | ((val << 24) & 0xff000000);
+}
+
+static inline uint64_t swap64(uint64_t val) {
+  return ((uint64_t)swap32((uint32_t)val) << 32) |
+         swap32((uint32_t)(val >> 32));
+}
 
-  if (!parser->little_endian)
-    length = swap16(length);
+#ifdef _MSC_VER
+static inline int ctz64(uint64_t val) {
+  unsigned long index;
+  _BitScanForward64(&index, val);
+  return (int)index;
+}
+#else
+#define ctz64(val) __builtin_ctzll(val)
+#endif
 
-  if (parser->pos + length > parser->length) {
-    PyErr_SetString(PyExc_ValueError, "Unexpected end of data");
-    return NULL;
+/* Decodes an unsigned LEB128 varint of at most max_bytes bytes and returns
+   its encoded length, or 0 if it is truncated or too long. Varints of up to
+   8 bytes are decoded from one unaligned load: the first clear continuation
+   bit gives the length and the 7-bit groups are packed with three
+   shift-and-mask steps instead of a loop over the bytes. */
+static inline size_t uvarint_decode(const uint8_t *src, size_t avail,
+                                    size_t max_bytes, uint64_t *out) {
+  if (avail >= 8) {
+    uint64_t word;
+    memcpy(&word, src, 8);
+    uint64_t stops = ~word & 0x8080808080808080ull;
+    if (stops) {
+      size_t length = ((size_t)ctz64(stops) >> 3) + 1;
+      if (length > max_bytes)
+        return 0;
+      if (length < 8)
+        word &= (1ull << (length * 8)) - 1;
+      word &= 0x7f7f7f7f7f7f7f7full;
+      word = (word & 0x007f007f007f007full) |
+             ((word & 0x7f007f007f007f00ull) >> 1);
+      word = (word & 0x00003fff00003fffull) |
+             ((word & 0x3fff00003fff0000ull) >> 2);
+      word = (word & 0x000000000fffffffull) |
+             ((word & 0x0fffffff00000000ull) >> 4);
+      *out = word;
+      return length;
+    }
   }
 
-  PyObject *str = PyUnicode_DecodeUTF8(
-      (const char *)(parser->data + parser->pos), length, "ignore");
-  parser->pos += length;
-  return str;
+  uint64_t val = 0;
+  for (size_t i = 0; i < max_bytes && i < avail; i++) {
+    val |= (uint64_t)(src[i] & 0x7f) << (7 * i);
+    if (!(src[i] & 0x80)) {
+      *out = val;
+      return i + 1;
+    }
+  }
+  return 0;
 }
 
-static PyObject *read_tag_payload(NBTParser *parser, uint8_t tag_type);
+static inline int32_t zigzag32(uint32_t val) {
+  return (int32_t)(val >> 1) ^ -(int32_t)(val & 1);
+}
 
-static int read_tag_header(NBTParser *parser, uint8_t *tag_type,
-                           PyObject **name) {
-  if (read_byte(parser, tag_type) < 0)
-    return -1;
+static inline int64_t zigzag64(uint64_t val) {
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
 
-  if (*tag_type == TAG_END) {
-    *name = PyUnicode_FromString("");
+static int source_fill(NBTParser *parser, size_t count);
+
+/* When the input is a compressed stream, running out of data refills the
+   window from it before giving up. */
+static int need(NBTParser *parser, size_t count) {
+  if (count <= parser->length - parser->pos)
     return 0;
+  if (parser->source && source_fill(parser, count) < 0)
+    return -1;
+  if (count > parser->length - parser->pos) {
+    parser->starved = 1;
+    PyErr_SetString(PyExc_ValueError, "Unexpected end of data");
+    return -1;
   }
+  return 0;
+}
 
-  *name = read_string(parser);
-  if (*name == NULL)
+static int read_byte(NBTParser *parser, uint8_t *out) {
+  if (need(parser, 1) < 0)
     return -1;
-
+  *out = parser->data[parser->pos++];
   return 0;
 }
 
-static PyObject *read_tag_payload(NBTParser *parser, uint8_t tag_type) {
-  if (tag_type == TAG_TBD) {
-    if (read_byte(parser, &tag_type) < 0)
-      return NULL;
-  }
-
+static size_t fixed_payload_size(uint8_t tag_type) {
   switch (tag_type) {
-  case TAG_END:
-    Py_RETURN_NONE;
-
-  case TAG_BYTE: {
-    int8_t val;
-    if (read_bytes(parser, &val, 1) < 0)
-      return NULL;
-    return PyLong_FromLong(val);
+  case TAG_BYTE:
+    return 1;
+  case TAG_SHORT:
+    return 2;
+  case TAG_INT:
+  case TAG_FLOAT:
+    return 4;
+  case TAG_LONG:
+  case TAG_DOUBLE:
+    return 8;
+  default:
+    return 0;
   }
+}
 
-  case TAG_SHORT: {
-    int16_t val;
-    if (read_short(parser, &val) < 0)
-      return NULL;
-    return PyLong_FromLong(val);
+static void cache_clear(ParseCache *cache) {
+  for (size_t i = 0; i < KEY_CACHE_SLOTS; i++)
+    Py_CLEAR(cache->keys[i].str);
+  for (size_t i = 0; i < SHAPE_SLOTS; i++) {
+    Shape *shape = &cache->shapes[i];
+    for (Py_ssize_t k = 0; k < shape->count; k++)
+      Py_DECREF(shape->keys[k]);
+    shape->count = 0;
   }
+  cache->key_hits = cache->key_misses = 0;
+  cache->shape_hits = cache->shape_misses = 0;
+}
 
-  case TAG_INT: {
-    int32_t val;
-    if (read_int(parser, &val) < 0)
-      return NULL;
-    return PyLong_FromLong(val);
+static inline uint64_t key_hash(const uint8_t *data, size_t length) {
+  uint64_t hash = length * 0x9E3779B97F4A7C15ull;
+  while (length >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data, 8);
+    hash = (hash ^ chunk) * 0xFF51AFD7ED558CCDull;
+    data += 8;
+    length -= 8;
   }
-
-  case TAG_LONG: {
-    int64_t val;
-    if (read_long(parser, &val) < 0)
-      return NULL;
-    return PyLong_FromLongLong(val);
+  if (length) {
+    uint64_t chunk = 0;
+    memcpy(&chunk, data, length);
+    hash = (hash ^ chunk) * 0xFF51AFD7ED558CCDull;
   }
+  return hash ^ (hash >> 29);
+}
 
-  case TAG_FLOAT: {
-    float val;
-    if (read_float(parser, &val) < 0)
-      return NULL;
-    return PyFloat_FromDouble(val);
+static PyObject *decode_string(const uint8_t *data, size_t length);
+
+/* Compound keys repeat heavily across a corpus, so short ones are decoded
+   once into interned strings (with their hash computed) and reused. */
+static PyObject *key_cache_get(ParseCache *cache, const uint8_t *data,
+                               size_t length) {
+  if (length > KEY_CACHE_MAX_LENGTH)
+    return decode_string(data, length);
+
+  uint64_t hash = key_hash(data, length);
+  KeyCacheSlot *slot = &cache->keys[hash & (KEY_CACHE_SLOTS - 1)];
+  if (slot->str && slot->hash == hash && slot->length == length &&
+      memcmp(slot->bytes, data, length) == 0) {
+    cache->key_hits++;
+    Py_INCREF(slot->str);
+    return slot->str;
   }
 
-  case TAG_DOUBLE: {
-    double val;
-    if (read_double(parser, &val) < 0)
-      return NULL;
-    return PyFloat_FromDouble(val);
+  PyObject *str = decode_string(data, length);
+  if (!str)
+    return NULL;
+  PyUnicode_InternInPlace(&str);
+  if (PyObject_Hash(str) == -1) {
+    Py_DECREF(str);
+    return NULL;
   }
 
-  case TAG_BYTE_ARRAY: {
-    int32_t length;
-    if (read_int(parser, &length) < 0)
-      return NULL;
+  cache->key_misses++;
+  Py_XSETREF(slot->str, str);
+  Py_INCREF(str);
+  slot->hash = hash;
+  slot->length = (uint16_t)length;
+  memcpy(slot->bytes, data, length);
+  return str;
+}
 
-    PyObject *list = PyList_New(length);
-    if (!list)
-      return NULL;
+static Shape *shape_slot(ParseCache *cache, PyObject *first_key) {
+  return &cache->shapes[((uintptr_t)first_key >> 4) & (SHAPE_SLOTS - 1)];
+}
 
-    for (int32_t i = 0; i < length; i++) {
-      int8_t val;
-      if (read_bytes(parser, &val, 1) < 0) {
-        Py_DECREF(list);
-        return NULL;
-      }
-      PyList_SET_ITEM(list, i, PyLong_FromLong(val));
+static void shape_store(Shape *shape, PyObject *dict) {
+  Py_ssize_t count = PyDict_GET_SIZE(dict);
+  if (count > SHAPE_MAX_KEYS)
+    return;
+
+  Shape next;
+  Py_ssize_t pos = 0, i = 0;
+  PyObject *key, *value;
+  while (PyDict_Next(dict, &pos, &key, &value)) {
+    next.names[i] = PyUnicode_AsUTF8AndSize(key, &next.lengths[i]);
+    if (!next.names[i]) {
+      PyErr_Clear();
+      return;
     }
-    return list;
+    next.keys[i++] = key;
   }
 
-  case TAG_STRING:
-    return read_string(parser);
-
-  case TAG_LIST: {
-    uint8_t elem_type;
-    int32_t length;
+  for (i = 0; i < count; i++)
+    Py_INCREF(next.keys[i]);
+  for (i = 0; i < shape->count; i++)
+    Py_DECREF(shape->keys[i]);
+  next.count = count;
+  *shape = next;
+}
 
-    if (read_byte(parser, &elem_type) < 0)
-      return NULL;
-    if (read_int(parser, &length) < 0)
-      return NULL;
+enum { SIMD_SCALAR, SIMD_SSSE3, SIMD_AVX2, SIMD_AVX512 };
 
-    if (length < 0) {
-      PyErr_Format(PyExc_ValueError, "Invalid list length: %d", length);
-      return NULL;
-    }
+static const char *simd_names[] = {"scalar", "ssse3", "avx2", "avx512"};
 
-    if (elem_type == TAG_END && length != 0) {
-      PyErr_SetString(PyExc_ValueError,
-                      "List has element type TAG_End but non-zero length");
-      return NULL;
-    }
+typedef struct {
+  int level;
+  void (*bswap32)(void *dst, const uint8_t *src, size_t count);
+  void (*bswap64)(void *dst, const uint8_t *src, size_t count);
+  size_t (*b64_blocks)(const uint8_t *src, size_t length, uint8_t *dst);
+  int (*ascii)(const uint8_t *src, size_t length);
+} Kernels;
 
-    PyObject *list = PyList_New(length);
-    if (!list)
-      return NULL;
+static Kernels kernels;
 
-    for (int32_t i = 0; i < length; i++) {
-      PyObject *item = read_tag_payload(parser, elem_type);
-      if (!item) {
-        Py_DECREF(list);
-        return NULL;
-      }
-      PyList_SET_ITEM(list, i, item);
-    }
+static void bswap32_scalar(void *dst, const uint8_t *src, size_t count) {
+  uint8_t *out = dst;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t val;
+    memcpy(&val, src + i * 4, 4);
+    val = swap32(val);
+    memcpy(out + i * 4, &val, 4);
+  }
+}
 
-    return list;
+static void bswap64_scalar(void *dst, const uint8_t *src, size_t count) {
+  uint8_t *out = dst;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t val;
+    memcpy(&val, src + i * 8, 8);
+    val = swap64(val);
+    memcpy(out + i * 8, &val, 8);
   }
+}
 
-  case TAG_COMPOUND: {
-    PyObject *dict = PyDict_New();
-    if (!dict)
-      return NULL;
+static int ascii_scalar(const uint8_t *src, size_t length) {
+  uint64_t bits = 0;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    bits |= word;
+  }
+  uint8_t tail = 0;
+  for (; i < length; i++)
+    tail |= src[i];
+  return !(bits & 0x8080808080808080ull) && !(tail & 0x80);
+}
 
-    while (1) {
-      uint8_t child_tag;
-      if (read_byte(parser, &child_tag) < 0) {
-        Py_DECREF(dict);
-        return NULL;
-      }
+#ifdef NBT_X86
+#define BSWAP32_SHUFFLE 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define BSWAP64_SHUFFLE 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
 
-      if (child_tag == TAG_END) {
-        break;
-      }
+static NBT_TARGET("ssse3") void bswap32_ssse3(void *dst, const uint8_t *src,
+                                               size_t count) {
+  uint8_t *out = dst;
+  const __m128i shuffle = _mm_setr_epi8(BSWAP32_SHUFFLE);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    _mm_storeu_si128((__m128i *)(out + i * 4), _mm_shuffle_epi8(a, shuffle));
+  }
+  bswap32_scalar(out + i * 4, src + i * 4, count - i);
+}
 
-      PyObject *child_name = read_string(parser);
-      if (!child_name) {
-        Py_DECREF(dict);
-        return NULL;
-      }
+static NBT_TARGET("ssse3") void bswap64_ssse3(void *dst, const uint8_t *src,
+                                               size_t count) {
+  uint8_t *out = dst;
+  const __m128i shuffle = _mm_setr_epi8(BSWAP64_SHUFFLE);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 8));
+    _mm_storeu_si128((__m128i *)(out + i * 8), _mm_shuffle_epi8(a, shuffle));
+  }
+  bswap64_scalar(out + i * 8, src + i * 8, count - i);
+}
 
-      PyObject *value = read_tag_payload(parser, child_tag);
-      if (!value) {
-        Py_DECREF(child_name);
-        Py_DECREF(dict);
-        return NULL;
-      }
+static NBT_TARGET("avx2") void bswap32_avx2(void *dst, const uint8_t *src,
+                                             size_t count) {
+  uint8_t *out = dst;
+  const __m256i shuffle = _mm256_setr_epi8(BSWAP32_SHUFFLE, BSWAP32_SHUFFLE);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i * 4 + 32));
+    _mm256_storeu_si256((__m256i *)(out + i * 4),
+                        _mm256_shuffle_epi8(a, shuffle));
+    _mm256_storeu_si256((__m256i *)(out + i * 4 + 32),
+                        _mm256_shuffle_epi8(b, shuffle));
+  }
+  bswap32_ssse3(out + i * 4, src + i * 4, count - i);
+}
 
-      if (PyDict_SetItem(dict, child_name, value) < 0) {
-        Py_DECREF(value);
-        Py_DECREF(child_name);
-        Py_DECREF(dict);
-        return NULL;
-      }
+static NBT_TARGET("avx2") void bswap64_avx2(void *dst, const uint8_t *src,
+                                             size_t count) {
+  uint8_t *out = dst;
+  const __m256i shuffle = _mm256_setr_epi8(BSWAP64_SHUFFLE, BSWAP64_SHUFFLE);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(src + i * 8));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i * 8 + 32));
+    _mm256_storeu_si256((__m256i *)(out + i * 8),
+                        _mm256_shuffle_epi8(a, shuffle));
+    _mm256_storeu_si256((__m256i *)(out + i * 8 + 32),
+                        _mm256_shuffle_epi8(b, shuffle));
+  }
+  bswap64_ssse3(out + i * 8, src + i * 8, count - i);
+}
 
-      Py_DECREF(child_name);
-      Py_DECREF(value);
-    }
+static NBT_TARGET("avx512f,avx512bw") void bswap32_avx512(void *dst,
+                                                          const uint8_t *src,
+                                                          size_t count) {
+  uint8_t *out = dst;
+  const __m512i shuffle =
+      _mm512_broadcast_i32x4(_mm_setr_epi8(BSWAP32_SHUFFLE));
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i a = _mm512_loadu_si512((const void *)(src + i * 4));
+    _mm512_storeu_si512((void *)(out + i * 4), _mm512_shuffle_epi8(a, shuffle));
+  }
+  bswap32_ssse3(out + i * 4, src + i * 4, count - i);
+}
 
-    return dict;
+static NBT_TARGET("avx512f,avx512bw") void bswap64_avx512(void *dst,
+                                                          const uint8_t *src,
+                                                          size_t count) {
+  uint8_t *out = dst;
+  const __m512i shuffle =
+      _mm512_broadcast_i32x4(_mm_setr_epi8(BSWAP64_SHUFFLE));
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void *)(src + i * 8));
+    _mm512_storeu_si512((void *)(out + i * 8), _mm512_shuffle_epi8(a, shuffle));
   }
-  case TAG_INT_ARRAY: {
-    int32_t length;
-    if (read_int(parser, &length) < 0)
-      return NULL;
+  bswap64_ssse3(out + i * 8, src + i * 8, count - i);
+}
 
-    PyObject *list = PyList_New(length);
-    if (!list)
-      return NULL;
+static NBT_TARGET("ssse3") int ascii_ssse3(const uint8_t *src,
+                                            size_t length) {
+  __m128i bits = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16)
+    bits = _mm_or_si128(bits, _mm_loadu_si128((const __m128i *)(src + i)));
+  return !_mm_movemask_epi8(bits) && ascii_scalar(src + i, length - i);
+}
 
-    for (int32_t i = 0; i < length; i++) {
-      int32_t val;
-      if (read_int(parser, &val) < 0) {
-        Py_DECREF(list);
-        return NULL;
+static NBT_TARGET("avx2") int ascii_avx2(const uint8_t *src, size_t length) {
+  __m256i bits = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32)
+    bits = _mm256_or_si256(bits,
+                           _mm256_loadu_si256((const __m256i *)(src + i)));
+  return !_mm256_movemask_epi8(bits) && ascii_ssse3(src + i, length - i);
+}
+#endif
+
+#define MUTF8_SMALL 256
+
+static inline int mutf8_cont(uint8_t byte) { return (byte & 0xC0) == 0x80; }
+
+/* Decodes one character of Java's Modified UTF-8 at src[0..left): NUL as
+   C0 80 and supplementary characters as pairs of 3-byte surrogates.
+   Standard 4-byte sequences (as written by Bedrock) are accepted too.
+   Malformed bytes and unpaired surrogates become U+FFFD instead of being
+   dropped. */
+static inline Py_UCS4 mutf8_next(const uint8_t *src, size_t left,
+                                 size_t *width) {
+  uint8_t lead = src[0];
+  *width = 1;
+  if (lead < 0x80)
+    return lead;
+
+  if ((lead & 0xE0) == 0xC0) {
+    if (left >= 2 && mutf8_cont(src[1])) {
+      *width = 2;
+      return (Py_UCS4)(lead & 0x1F) << 6 | (src[1] & 0x3F);
+    }
+  } else if ((lead & 0xF0) == 0xE0) {
+    if (left >= 3 && mutf8_cont(src[1]) && mutf8_cont(src[2])) {
+      Py_UCS4 ch = (Py_UCS4)(lead & 0x0F) << 12 |
+                   (Py_UCS4)(src[1] & 0x3F) << 6 | (src[2] & 0x3F);
+      *width = 3;
+      if (ch >= 0xD800 && ch <= 0xDBFF && left >= 6 && src[3] == 0xED &&
+          (src[4] & 0xF0) == 0xB0 && mutf8_cont(src[5])) {
+        Py_UCS4 low = 0xDC00 | (Py_UCS4)(src[4] & 0x0F) << 6 | (src[5] & 0x3F);
+        *width = 6;
+        return 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
       }
-      PyList_SET_ITEM(list, i, PyLong_FromLong(val));
+      return ch >= 0xD800 && ch <= 0xDFFF ? 0xFFFD : ch;
+    }
+  } else if ((lead & 0xF8) == 0xF0) {
+    if (left >= 4 && mutf8_cont(src[1]) && mutf8_cont(src[2]) &&
+        mutf8_cont(src[3])) {
+      Py_UCS4 ch = (Py_UCS4)(lead & 0x07) << 18 |
+                   (Py_UCS4)(src[1] & 0x3F) << 12 |
+                   (Py_UCS4)(src[2] & 0x3F) << 6 | (src[3] & 0x3F);
+      *width = 4;
+      return ch > 0x10FFFF ? 0xFFFD : ch;
     }
-    return list;
   }
+  return 0xFFFD;
+}
 
-  case TAG_LONG_ARRAY: {
-    int32_t length;
-    if (read_int(parser, &length) < 0)
-      return NULL;
-
-    PyObject *list = PyList_New(length);
-    if (!list)
-      return NULL;
+/* Writes every character of src[0..length) into `str`, which must have been
+   created from its exact length and maximum. */
+#define MUTF8_WRITE(type)                                                      \
+  do {                                                                         \
+    type *out = (type *)PyUnicode_DATA(str);                                   \
+    for (size_t i = 0, width; i < length; i += width)                          \
+      *out++ = (type)mutf8_next(src + i, length - i, &width);                  \
+  } while (0)
 
-    for (int32_t i = 0; i < length; i++) {
-      int64_t val;
-      if (read_long(parser, &val) < 0) {
-        Py_DECREF(list);
-        return NULL;
-      }
-      PyList_SET_ITEM(list, i, PyLong_FromLongLong(val));
+/* Writers for the first attempt, into a str sized from the first pass:
+   Latin-1 text may only hold C2/C3 sequences, BMP text only canonical 2-
+   and 3-byte ones outside the surrogate block, and wide text must reach
+   past the BMP. Anything else, or a character count that does not match,
+   abandons the attempt. */
+static int mutf8_latin1(PyObject *str, const uint8_t *src, size_t length) {
+  Py_UCS1 *out = PyUnicode_1BYTE_DATA(str);
+  Py_UCS1 *end = out + PyUnicode_GET_LENGTH(str);
+  size_t i = 0;
+  while (i < length) {
+    if (out == end)
+      return -1;
+    uint8_t lead = src[i];
+    if (lead < 0x80) {
+      *out++ = lead;
+      i++;
+    } else if ((lead & 0xFE) == 0xC2 && i + 1 < length &&
+               mutf8_cont(src[i + 1])) {
+      *out++ = (Py_UCS1)((lead & 0x03) << 6 | (src[i + 1] & 0x3F));
+      i += 2;
+    } else {
+      return -1;
     }
-    return list;
   }
+  return out == end ? 0 : -1;
+}
 
-  default:
-    PyErr_Format(PyExc_ValueError, "Unknown tag type: %d", tag_type);
-    return NULL;
+static int mutf8_bmp(PyObject *str, const uint8_t *src, size_t length) {
+  Py_UCS2 *out = PyUnicode_2BYTE_DATA(str);
+  Py_UCS2 *end = out + PyUnicode_GET_LENGTH(str);
+  size_t i = 0;
+  while (i < length) {
+    if (out == end)
+      return -1;
+    uint8_t lead = src[i];
+    if (lead < 0x80) {
+      *out++ = lead;
+      i++;
+    } else if (lead >= 0xC2 && lead < 0xE0 && i + 1 < length &&
+               mutf8_cont(src[i + 1])) {
+      *out++ = (Py_UCS2)((lead & 0x1F) << 6 | (src[i + 1] & 0x3F));
+      i += 2;
+    } else if ((lead & 0xF0) == 0xE0 && i + 2 < length &&
+               mutf8_cont(src[i + 1]) && mutf8_cont(src[i + 2]) &&
+               (lead != 0xE0 || src[i + 1] >= 0xA0) &&
+               (lead != 0xED || src[i + 1] < 0xA0)) {
+      *out++ = (Py_UCS2)((lead & 0x0F) << 12 | (src[i + 1] & 0x3F) << 6 |
+                         (src[i + 2] & 0x3F));
+      i += 3;
+    } else {
+      return -1;
+    }
   }
+  return out == end ? 0 : -1;
 }
 
-static PyObject *parse_nbt(PyObject *self, PyObject *args) {
-  Py_buffer data;
-  if (!PyArg_ParseTuple(args, "y*", &data)) {
-    return NULL;
+static int mutf8_wide(PyObject *str, const uint8_t *src, size_t length) {
+  Py_UCS4 *out = PyUnicode_4BYTE_DATA(str);
+  Py_UCS4 *end = out + PyUnicode_GET_LENGTH(str);
+  Py_UCS4 maxchar = 0;
+  for (size_t i = 0, width; i < length; i += width) {
+    if (out == end)
+      return -1;
+    Py_UCS4 ch = mutf8_next(src + i, length - i, &width);
+    maxchar = ch > maxchar ? ch : maxchar;
+    *out++ = ch;
   }
+  return out == end && maxchar > 0xFFFF ? 0 : -1;
+}
 
-  NBTParser parser;
-  parser.data = (const uint8_t *)data.buf;
-  parser.length = data.len;
-  parser.pos = 0;
-  parser.little_endian = 1;
+/* Decodes straight into the result. In well-formed text without overlong
+   forms every non-continuation byte starts a character, except the second
+   half of a surrogate pair, and the largest byte gives the kind; a first
+   pass the compiler vectorizes finds both. The result is allocated from
+   that guess and filled by the matching writer; text the guess gets wrong
+   is measured character by character and written again. */
+static PyObject *decode_mutf8(const uint8_t *src, size_t length) {
+  size_t count = length, surrogates = 0;
+  uint8_t top = 0;
+  for (size_t i = 0; i < length; i += 128) {
+    size_t block = length - i < 128 ? length - i : 128;
+    uint8_t cont = 0, ed = 0;
+    for (size_t j = 0; j < block; j++) {
+      cont += (int8_t)src[i + j] < -64;
+      ed += src[i + j] == 0xED;
+      top = src[i + j] > top ? src[i + j] : top;
+    }
+    count -= cont;
+    surrogates += ed;
+  }
 
-  uint8_t root_type;
-  if (read_byte(&parser, &root_type) < 0) {
-    PyBuffer_Release(&data);
-    return NULL;
+  PyObject *str;
+  if (surrogates || top >= 0xF0) {
+    /* A pair spends two leading bytes on one character. */
+    count -= surrogates / 2;
+    if (!(str = PyUnicode_New((Py_ssize_t)count, 0x10FFFF)))
+      return NULL;
+    if (mutf8_wide(str, src, length) == 0)
+      return str;
+    Py_DECREF(str);
+  } else if (top >= 0xC2) {
+    int latin1 = top < 0xC4;
+    if (!(str = PyUnicode_New((Py_ssize_t)count, latin1 ? 0xFF : 0xFFFF)))
+      return NULL;
+    if ((latin1 ? mutf8_latin1 : mutf8_bmp)(str, src, length) == 0)
+      return str;
+    Py_DECREF(str);
   }
 
-  PyObject *root_name = read_string(&parser);
-  if (!root_name) {
-    PyBuffer_Release(&data);
+  Py_UCS4 maxchar = 0;
+  count = 0;
+  for (size_t i = 0, width; i < length; i += width, count++) {
+    Py_UCS4 ch = mutf8_next(src + i, length - i, &width);
+    maxchar = ch > maxchar ? ch : maxchar;
+  }
+  if (!(str = PyUnicode_New((Py_ssize_t)count, maxchar)))
     return NULL;
+  switch (PyUnicode_KIND(str)) {
+  case PyUnicode_1BYTE_KIND:
+    MUTF8_WRITE(Py_UCS1);
+    break;
+  case PyUnicode_2BYTE_KIND:
+    MUTF8_WRITE(Py_UCS2);
+    break;
+  default:
+    MUTF8_WRITE(Py_UCS4);
+    break;
   }
+  return str;
+}
 
-  Py_DECREF(root_name);
+/* Pure ASCII strings (nearly all keys and ids) are copied straight into a
+   one-byte str, skipping the Modified UTF-8 decoder. */
+static PyObject *decode_string(const uint8_t *data, size_t length) {
+  if (!kernels.ascii(data, length))
+    return decode_mutf8(data, length);
 
-  PyObject *result = read_tag_payload(&parser, root_type);
-  PyBuffer_Release(&data);
-  return result;
+  PyObject *str = PyUnicode_New((Py_ssize_t)length, 127);
+  if (str)
+    memcpy(PyUnicode_1BYTE_DATA(str), data, length);
+  return str;
 }
 
-static PyMethodDef methods[] = {
-    {"parse_nbt", (PyCFunction)parse_nbt, METH_VARARGS,
+/* Re-encodes UTF-8 as Modified UTF-8: NUL becomes C0 80 and 4-byte
+   sequences become two 3-byte surrogates. `out` needs room for twice
+   `length` bytes. Returns the encoded length, which equals `length` only
+   when nothing changed. */
+static Py_ssize_t encode_mutf8(const char *utf8, Py_ssize_t length,
+                               char *out) {
+  const uint8_t *src = (const uint8_t *)utf8;
+  uint8_t *dst = (uint8_t *)out;
+  Py_ssize_t i = 0;
+  while (i < length) {
+    uint8_t lead = src[i];
+    if (lead == 0) {
+      *dst++ = 0xC0;
+      *dst++ = 0x80;
+      i++;
+    } else if (lead >= 0xF0 && i + 4 <= length) {
+      Py_UCS4 ch = (Py_UCS4)(lead & 0x07) << 18 |
+                   (Py_UCS4)(src[i + 1] & 0x3F) << 12 |
+                   (Py_UCS4)(src[i + 2] & 0x3F) << 6 | (src[i + 3] & 0x3F);
+      Py_UCS4 units[2] = {0xD800 + ((ch - 0x10000) >> 10),
+                          0xDC00 + ((ch - 0x10000) & 0x3FF)};
+      for (int j = 0; j < 2; j++) {
+        *dst++ = (uint8_t)(0xE0 | units[j] >> 12);
+        *dst++ = (uint8_t)(0x80 | (units[j] >> 6 & 0x3F));
+        *dst++ = (uint8_t)(0x80 | (units[j] & 0x3F));
+      }
+      i += 4;
+    } else {
+      *dst++ = lead;
+      i++;
+    }
+  }
+  return (Py_ssize_t)(dst - (uint8_t *)out);
+}
+
+/* A str key in the two byte forms a tag name may use for it: Modified
+   UTF-8 as written by Java, and standard UTF-8 as written by Bedrock. They
+   differ only for keys containing NUL or supplementary characters. */
+typedef struct {
+  const char *mutf8, *utf8;
+  Py_ssize_t mutf8_length, utf8_length;
+} NameKey;
+
+/* `small` holds MUTF8_SMALL bytes; longer encodings are stored in *heap,
+   which the caller releases with PyMem_Free. */
+static int name_key_init(NameKey *key, PyObject *str, char *small,
+                         char **heap) {
+  *heap = NULL;
+  key->utf8 = PyUnicode_AsUTF8AndSize(str, &key->utf8_length);
+  if (!key->utf8)
+    return -1;
+
+  key->mutf8 = key->utf8;
+  key->mutf8_length = key->utf8_length;
+  if (PyUnicode_IS_ASCII(str) && !memchr(key->utf8, 0, key->utf8_length))
+    return 0;
+
+  char *out = small;
+  if (key->utf8_length > MUTF8_SMALL / 2 &&
+      !(out = *heap = PyMem_Malloc((size_t)key->utf8_length * 2))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  Py_ssize_t length = encode_mutf8(key->utf8, key->utf8_length, out);
+  if (length != key->utf8_length) {
+    key->mutf8 = out;
+    key->mutf8_length = length;
+  }
+  return 0;
+}
+
+static inline int name_key_match(const NameKey *key, const uint8_t *name,
+                                 Py_ssize_t length) {
+  if (length == key->mutf8_length && !memcmp(name, key->mutf8, length))
+    return 1;
+  return key->mutf8 != key->utf8 && length == key->utf8_length &&
+         !memcmp(name, key->utf8, length);
+}
+
+#define ARRAY_CHUNK 256
+
+static PyObject *read_int_array_list(NBTParser *parser, int32_t length,
+                                     int swap) {
+  if (need(parser, (size_t)length * 4) < 0)
+    return NULL;
+
+  PyObject *list = PyList_New(length);
+  if (!list)
+    return NULL;
+
+  int32_t chunk[ARRAY_CHUNK];
+  for (int32_t i = 0; i < length; i += ARRAY_CHUNK) {
+    int32_t n = length - i < ARRAY_CHUNK ? length - i : ARRAY_CHUNK;
+    if (swap)
+      kernels.bswap32(chunk, parser->data + parser->pos, (size_t)n);
+    else
+      memcpy(chunk, parser->data + parser->pos, (size_t)n * 4);
+    parser->pos += (size_t)n * 4;
+
+    for (int32_t j = 0; j < n; j++) {
+      PyObject *item = PyLong_FromLong(chunk[j]);
+      if (!item) {
+        Py_DECREF(list);
+        return NULL;
+      }
+      PyList_SET_ITEM(list, i + j, item);
+    }
+  }
+  return list;
+}
+
+static PyObject *read_long_array_list(NBTParser *parser, int32_t length,
+                                      int swap) {
+  if (need(parser, (size_t)length * 8) < 0)
+    return NULL;
+
+  PyObject *list = PyList_New(length);
+  if (!list)
+    return NULL;
+
+  int64_t chunk[ARRAY_CHUNK];
+  for (int32_t i = 0; i < length; i += ARRAY_CHUNK) {
+    int32_t n = length - i < ARRAY_CHUNK ? length - i : ARRAY_CHUNK;
+    if (swap)
+      kernels.bswap64(chunk, parser->data + parser->pos, (size_t)n);
+    else
+      memcpy(chunk, parser->data + parser->pos, (size_t)n * 8);
+    parser->pos += (size_t)n * 8;
+
+    for (int32_t j = 0; j < n; j++) {
+      PyObject *item = PyLong_FromLongLong(chunk[j]);
+      if (!item) {
+        Py_DECREF(list);
+        return NULL;
+      }
+      PyList_SET_ITEM(list, i + j, item);
+    }
+  }
+  return list;
+}
+
+static PyObject *numpy_frombuffer = NULL;
+static PyObject *numpy_dtypes[3] = {NULL, NULL, NULL};
+
+static int load_numpy(void) {
+  if (numpy_frombuffer)
+    return 0;
+
+  PyObject *numpy = PyImport_ImportModule("numpy");
+  if (!numpy)
+    return -1;
+
+  static const char *dtype_names[3] = {"i1", "i4", "i8"};
+  PyObject *dtype = PyObject_GetAttrString(numpy, "dtype");
+  PyObject *frombuffer = PyObject_GetAttrString(numpy, "frombuffer");
+  Py_DECREF(numpy);
+  if (!dtype || !frombuffer)
+    goto fail;
+
+  for (int i = 0; i < 3; i++) {
+    numpy_dtypes[i] = PyObject_CallFunction(dtype, "s", dtype_names[i]);
+    if (!numpy_dtypes[i])
+      goto fail;
+  }
+  Py_DECREF(dtype);
+  numpy_frombuffer = frombuffer;
+  return 0;
+
+fail:
+  Py_XDECREF(dtype);
+  Py_XDECREF(frombuffer);
+  for (int i = 0; i < 3; i++)
+    Py_CLEAR(numpy_dtypes[i]);
+  return -1;
+}
+
+static PyObject *typed_array_storage(NBTParser *parser, size_t bytes) {
+  if (parser->array_mode == ARRAYS_NUMPY && load_numpy() < 0)
+    return NULL;
+  return PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)bytes);
+}
+
+/* Wraps native-order elements of the given size as a memoryview or numpy
+   array, consuming the reference to storage. */
+static PyObject *typed_array_wrap(NBTParser *parser, PyObject *storage,
+                                  size_t size) {
+  PyObject *result;
+  if (parser->array_mode == ARRAYS_NUMPY) {
+    int dtype = size == 1 ? 0 : size == 4 ? 1 : 2;
+    result = PyObject_CallFunctionObjArgs(numpy_frombuffer, storage,
+                                          numpy_dtypes[dtype], NULL);
+  } else {
+    const char *format = size == 1 ? "b" : size == 4 ? "i" : "q";
+    PyObject *view = PyMemoryView_FromObject(storage);
+    result = view ? PyObject_CallMethod(view, "cast", "s", format) : NULL;
+    Py_XDECREF(view);
+  }
+  Py_DECREF(storage);
+  return result;
+}
+
+static PyObject *read_typed_array(NBTParser *parser, uint8_t tag_type,
+                                  int32_t length, int swap) {
+  size_t size = tag_type == TAG_BYTE_ARRAY  ? 1
+                : tag_type == TAG_INT_ARRAY ? 4
+                                            : 8;
+  size_t bytes = (size_t)length * size;
+  if (need(parser, bytes) < 0)
+    return NULL;
+
+  PyObject *storage = typed_array_storage(parser, bytes);
+  if (!storage)
+    return NULL;
+
+  const uint8_t *src = parser->data + parser->pos;
+  char *dst = PyByteArray_AS_STRING(storage);
+  if (swap && size == 4)
+    kernels.bswap32(dst, src, (size_t)length);
+  else if (swap && size == 8)
+    kernels.bswap64(dst, src, (size_t)length);
+  else
+    memcpy(dst, src, bytes);
+  parser->pos += bytes;
+
+  return typed_array_wrap(parser, storage, size);
+}
+
+static PyObject *read_lazy_compound(NBTParser *parser, int depth);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NBT_COMPUTED_GOTO
+#endif
+
+#define DECODE_STACK_INLINE 32
+
+/* An open list or compound. Lists fill container[index..length), compounds
+   hold the key of the child being decoded and the shape they follow. */
+typedef struct {
+  PyObject *container;
+  PyObject *key;
+  Shape *shape;
+  Py_ssize_t index;
+  Py_ssize_t length;
+  uint8_t kind;
+  uint8_t elem_type;
+  uint8_t hit;
+} DecodeFrame;
+
+typedef struct {
+  DecodeFrame *frames;
+  int depth;
+  int capacity;
+  DecodeFrame small[DECODE_STACK_INLINE];
+} DecodeStack;
+
+static DecodeFrame *stack_push(NBTParser *parser, DecodeStack *stack) {
+  if (stack->depth + parser->base_depth >= parser->max_depth) {
+    PyErr_Format(PyExc_ValueError, "Maximum nesting depth of %d exceeded",
+                 parser->max_depth);
+    return NULL;
+  }
+
+  if (stack->depth == stack->capacity) {
+    size_t size = (size_t)stack->capacity * 2 * sizeof(DecodeFrame);
+    DecodeFrame *frames = stack->frames == stack->small
+                              ? PyMem_Malloc(size)
+                              : PyMem_Realloc(stack->frames, size);
+    if (!frames) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+    if (stack->frames == stack->small)
+      memcpy(frames, stack->small, sizeof(stack->small));
+    stack->frames = frames;
+    stack->capacity *= 2;
+  }
+  return &stack->frames[stack->depth++];
+}
+
+static void stack_free(DecodeStack *stack) {
+  while (stack->depth > 0) {
+    DecodeFrame *frame = &stack->frames[--stack->depth];
+    Py_XDECREF(frame->key);
+    Py_DECREF(frame->container);
+  }
+  if (stack->frames != stack->small)
+    PyMem_Free(stack->frames);
+}
+
+static void stack_move(DecodeStack *dst, const DecodeStack *src) {
+  *dst = *src;
+  if (src->frames == src->small)
+    dst->frames = dst->small;
+}
+
+/* Decoder state parked when an incremental parser runs out of input: the
+   open frames, and either the tag whose value starts at the rollback point
+   or (in_header) the next child header of the innermost compound. */
+struct DecodeResume {
+  DecodeStack stack;
+  uint8_t tag_type;
+  uint8_t in_header;
+  uint8_t active;
+};
+
+#define NBT_BIG_ENDIAN 1
+#include "nbt2dict_decode.h"
+#undef NBT_BIG_ENDIAN
+
+#define NBT_BIG_ENDIAN 0
+#include "nbt2dict_decode.h"
+
+#define NBT_VARINT
+#include "nbt2dict_decode.h"
+#undef NBT_VARINT
+#undef NBT_BIG_ENDIAN
+
+#define BY_ENDIAN(parser, name, ...)                                           \
+  ((parser)->varint          ? name##_net(__VA_ARGS__)                         \
+   : (parser)->little_endian ? name##_le(__VA_ARGS__)                          \
+                             : name##_be(__VA_ARGS__))
+
+static PyObject *read_string(NBTParser *parser) {
+  return BY_ENDIAN(parser, read_string, parser);
+}
+
+static PyObject *read_key(NBTParser *parser) {
+  return BY_ENDIAN(parser, read_key, parser);
+}
+
+static int read_key_bytes(NBTParser *parser, const uint8_t **data,
+                          size_t *length) {
+  return BY_ENDIAN(parser, read_key_bytes, parser, data, length);
+}
+
+static PyObject *read_scalar_list(NBTParser *parser, uint8_t elem_type,
+                                  int32_t length) {
+  return BY_ENDIAN(parser, read_scalar_list, parser, elem_type, length);
+}
+
+static PyObject *load_scalar(NBTParser *parser, uint8_t tag_type) {
+  return BY_ENDIAN(parser, load_scalar, tag_type, parser->data + parser->pos);
+}
+
+static PyObject *read_tag_payload(NBTParser *parser, uint8_t tag_type) {
+  return BY_ENDIAN(parser, read_tag_payload, parser, tag_type);
+}
+
+static PyObject *parse_root(NBTParser *parser) {
+  return BY_ENDIAN(parser, parse_root, parser);
+}
+
+static int read_tag_header(NBTParser *parser, uint8_t *tag_type,
+                           PyObject **name) {
+  if (read_byte(parser, tag_type) < 0)
+    return -1;
+
+  if (*tag_type == TAG_END) {
+    *name = PyUnicode_FromString("");
+    return 0;
+  }
+
+  *name = read_string(parser);
+  if (*name == NULL)
+    return -1;
+
+  return 0;
+}
+
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+  /* set while a parse decodes out of data */
+  int busy;
+} ScratchBuffer;
+
+static ScratchBuffer b64_scratch = {NULL, 0, 0};
+static ScratchBuffer inflate_scratch = {NULL, 0, 0};
+
+/* Safe without the GIL; scratch_reserve() adds the MemoryError. */
+static int scratch_grow(ScratchBuffer *scratch, size_t capacity) {
+  if (capacity <= scratch->capacity)
+    return 0;
+
+  uint8_t *data = PyMem_RawRealloc(scratch->data, capacity);
+  if (!data)
+    return -1;
+  scratch->data = data;
+  scratch->capacity = capacity;
+  return 0;
+}
+
+static int scratch_reserve(ScratchBuffer *scratch, size_t capacity) {
+  if (scratch_grow(scratch, capacity) < 0) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return 0;
+}
+
+/* Decoding creates objects, so a __del__ or another thread can call back
+   into the module while a shared buffer is still being parsed from. Such
+   nested calls decode through `local`, which starts out empty. */
+static ScratchBuffer *scratch_acquire(ScratchBuffer *shared,
+                                      ScratchBuffer *local) {
+  memset(local, 0, sizeof(*local));
+  if (shared->busy)
+    return local;
+  shared->busy = 1;
+  return shared;
+}
+
+static void scratch_release(ScratchBuffer *scratch) {
+  if (scratch->busy)
+    scratch->busy = 0;
+  else
+    PyMem_RawFree(scratch->data);
+}
+
+#define B64_INVALID 0x80
+#define B64_SKIP 0x40
+
+static uint8_t b64_table[256];
+
+static void init_b64_table(void) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  memset(b64_table, B64_INVALID, sizeof(b64_table));
+  for (int i = 0; i < 64; i++)
+    b64_table[(uint8_t)alphabet[i]] = (uint8_t)i;
+  b64_table[' '] = b64_table['\t'] = b64_table['\r'] = b64_table['\n'] =
+      B64_SKIP;
+}
+
+#define B64_SLACK 32
+
+static size_t b64_blocks_scalar(const uint8_t *src, size_t length,
+                                uint8_t *dst) {
+  size_t i = 0;
+  while (i + 4 <= length) {
+    uint8_t a = b64_table[src[i]], b = b64_table[src[i + 1]],
+            c = b64_table[src[i + 2]], d = b64_table[src[i + 3]];
+    if ((a | b | c | d) & (B64_INVALID | B64_SKIP))
+      break;
+    uint32_t triple = (uint32_t)a << 18 | (uint32_t)b << 12 |
+                      (uint32_t)c << 6 | d;
+    dst[0] = (uint8_t)(triple >> 16);
+    dst[1] = (uint8_t)(triple >> 8);
+    dst[2] = (uint8_t)triple;
+    dst += 3;
+    i += 4;
+  }
+  return i;
+}
+
+#ifdef NBT_X86
+#define B64_LUT_LO                                                             \
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,      \
+      0x1B, 0x1B, 0x1B, 0x1A
+#define B64_LUT_HI                                                             \
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,      \
+      0x10, 0x10, 0x10, 0x10
+#define B64_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define B64_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+/* Nibble-lookup validation and translation (Mula & Lemire); a vector
+   holding padding, whitespace or invalid characters ends the loop and
+   is left to the scalar decoder. */
+static NBT_TARGET("ssse3") size_t b64_blocks_ssse3(const uint8_t *src,
+                                                    size_t length,
+                                                    uint8_t *dst) {
+  const __m128i lut_lo = _mm_setr_epi8(B64_LUT_LO);
+  const __m128i lut_hi = _mm_setr_epi8(B64_LUT_HI);
+  const __m128i lut_roll = _mm_setr_epi8(B64_LUT_ROLL);
+  const __m128i pack = _mm_setr_epi8(B64_PACK);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  size_t i = 0;
+
+  for (; i + 16 <= length; i += 16, dst += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i invalid =
+        _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+    if (_mm_movemask_epi8(invalid) != 0xFFFF)
+      break;
+
+    __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    in = _mm_add_epi8(in, roll);
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(in, pack));
+  }
+
+  return i + b64_blocks_scalar(src + i, length - i, dst);
+}
+
+static NBT_TARGET("avx2") size_t b64_blocks_avx2(const uint8_t *src,
+                                                  size_t length, uint8_t *dst) {
+  const __m256i lut_lo = _mm256_setr_epi8(B64_LUT_LO, B64_LUT_LO);
+  const __m256i lut_hi = _mm256_setr_epi8(B64_LUT_HI, B64_LUT_HI);
+  const __m256i lut_roll = _mm256_setr_epi8(B64_LUT_ROLL, B64_LUT_ROLL);
+  const __m256i pack = _mm256_setr_epi8(B64_PACK, B64_PACK);
+  const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  size_t i = 0;
+
+  for (; i + 32 <= length; i += 32, dst += 24) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+
+    __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+    __m256i roll =
+        _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    in = _mm256_add_epi8(in, roll);
+    in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+    in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+    in = _mm256_shuffle_epi8(in, pack);
+    _mm256_storeu_si256((__m256i *)dst,
+                        _mm256_permutevar8x32_epi32(in, compact));
+  }
+
+  return i + b64_blocks_ssse3(src + i, length - i, dst);
+}
+#endif
+
+static Py_ssize_t b64_decode(const uint8_t *src, size_t length, uint8_t *out) {
+  size_t i = kernels.b64_blocks(src, length, out);
+  uint8_t *dst = out + i / 4 * 3;
+
+  uint32_t accum = 0;
+  int quantum = 0, padding = 0;
+  for (; i < length; i++) {
+    uint8_t c = src[i];
+    uint8_t v = b64_table[c];
+    if (v == B64_SKIP)
+      continue;
+    if (c == '=') {
+      padding++;
+      continue;
+    }
+    if (v == B64_INVALID || padding)
+      return -1;
+
+    accum = accum << 6 | v;
+    if (++quantum == 4) {
+      dst[0] = (uint8_t)(accum >> 16);
+      dst[1] = (uint8_t)(accum >> 8);
+      dst[2] = (uint8_t)accum;
+      dst += 3;
+      accum = 0;
+      quantum = 0;
+    }
+  }
+
+  if (quantum == 1)
+    return -1;
+  if (quantum == 2) {
+    *dst++ = (uint8_t)(accum >> 4);
+  } else if (quantum == 3) {
+    *dst++ = (uint8_t)(accum >> 10);
+    *dst++ = (uint8_t)(accum >> 2);
+  }
+
+  return dst - out;
+}
+
+static int cpu_simd_level(void) {
+  int level = SIMD_SCALAR;
+#ifdef NBT_X86
+  unsigned int ecx1 = 0, ebx7 = 0;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+  if (max_leaf < 1)
+    return level;
+  __cpuid(info, 1);
+  ecx1 = (unsigned int)info[2];
+  if (max_leaf >= 7) {
+    __cpuidex(info, 7, 0);
+    ebx7 = (unsigned int)info[1];
+  }
+#else
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int max_leaf = __get_cpuid_max(0, NULL);
+  if (max_leaf < 1)
+    return level;
+  __cpuid(1, eax, ebx, ecx, edx);
+  ecx1 = ecx;
+  if (max_leaf >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    ebx7 = ebx;
+  }
+#endif
+
+  if (ecx1 & (1u << 9))
+    level = SIMD_SSSE3;
+
+  if (!(ecx1 & (1u << 27)))
+    return level;
+#ifdef _MSC_VER
+  uint64_t xcr0 = _xgetbv(0);
+#else
+  uint32_t xcr0_lo, xcr0_hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  uint64_t xcr0 = (uint64_t)xcr0_hi << 32 | xcr0_lo;
+#endif
+
+  if ((xcr0 & 0x06) == 0x06 && (ebx7 & (1u << 5)))
+    level = SIMD_AVX2;
+  if ((xcr0 & 0xE6) == 0xE6 && (ebx7 & (1u << 16)) && (ebx7 & (1u << 30)))
+    level = SIMD_AVX512;
+#endif
+  return level;
+}
+
+static void init_kernels(void) {
+  int level = cpu_simd_level();
+
+  const char *limit = getenv("NBT2DICT_SIMD");
+  if (limit) {
+    for (int i = SIMD_SCALAR; i <= SIMD_AVX512; i++) {
+      if (strcmp(limit, simd_names[i]) == 0 && i < level)
+        level = i;
+    }
+  }
+
+  kernels.level = level;
+  kernels.bswap32 = bswap32_scalar;
+  kernels.bswap64 = bswap64_scalar;
+  kernels.b64_blocks = b64_blocks_scalar;
+  kernels.ascii = ascii_scalar;
+
+#ifdef NBT_X86
+  switch (level) {
+  case SIMD_AVX512:
+    kernels.bswap32 = bswap32_avx512;
+    kernels.bswap64 = bswap64_avx512;
+    kernels.b64_blocks = b64_blocks_avx2;
+    kernels.ascii = ascii_avx2;
+    break;
+  case SIMD_AVX2:
+    kernels.bswap32 = bswap32_avx2;
+    kernels.bswap64 = bswap64_avx2;
+    kernels.b64_blocks = b64_blocks_avx2;
+    kernels.ascii = ascii_avx2;
+    break;
+  case SIMD_SSSE3:
+    kernels.bswap32 = bswap32_ssse3;
+    kernels.bswap64 = bswap64_ssse3;
+    kernels.b64_blocks = b64_blocks_ssse3;
+    kernels.ascii = ascii_ssse3;
+    break;
+  }
+#endif
+}
+
+/* Inflates without touching the GIL. On failure returns -1 with a message
+   in error, or an empty message when out of memory. */
+static Py_ssize_t inflate_raw(ScratchBuffer *scratch, const uint8_t *src,
+                              size_t length, char *error, size_t error_size) {
+  error[0] = '\0';
+  size_t guess = length * 4;
+  if (length >= 18 && src[0] == 0x1f && src[1] == 0x8b) {
+    const uint8_t *isize = src + length - 4;
+    guess = (size_t)isize[0] | (size_t)isize[1] << 8 |
+            (size_t)isize[2] << 16 | (size_t)isize[3] << 24;
+    if (guess / 1032 > length)
+      guess = length * 1032;
+  }
+  if (scratch_grow(scratch, guess + 1) < 0)
+    return -1;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+    snprintf(error, error_size, "Could not initialize zlib");
+    return -1;
+  }
+
+  stream.next_in = (Bytef *)src;
+  size_t total = 0;
+  int status = Z_OK;
+
+  while (status != Z_STREAM_END) {
+    if (total == scratch->capacity &&
+        scratch_grow(scratch, scratch->capacity * 2) < 0) {
+      inflateEnd(&stream);
+      return -1;
+    }
+
+    size_t in_left = length - (size_t)((const uint8_t *)stream.next_in - src);
+    stream.avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+    size_t out_left = scratch->capacity - total;
+    stream.avail_out = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+    stream.next_out = scratch->data + total;
+
+    status = inflate(&stream, Z_NO_FLUSH);
+    total = (size_t)(stream.next_out - scratch->data);
+
+    /* gzip.decompress() semantics: concatenated members are one stream */
+    if (status == Z_STREAM_END && stream.avail_in >= 2 &&
+        stream.next_in[0] == 0x1f && stream.next_in[1] == 0x8b) {
+      inflateReset(&stream);
+      status = Z_OK;
+    }
+
+    if (status == Z_BUF_ERROR && in_left == 0)
+      status = Z_DATA_ERROR;
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+      snprintf(error, error_size, "Invalid compressed data: %s",
+               stream.msg ? stream.msg : "truncated stream");
+      inflateEnd(&stream);
+      return -1;
+    }
+  }
+
+  inflateEnd(&stream);
+  return (Py_ssize_t)total;
+}
+
+static Py_ssize_t inflate_into(ScratchBuffer *scratch, const uint8_t *src,
+                               size_t length) {
+  char error[64];
+  Py_ssize_t total = inflate_raw(scratch, src, length, error, sizeof(error));
+  if (total < 0 && error[0])
+    PyErr_SetString(PyExc_ValueError, error);
+  else if (total < 0)
+    PyErr_NoMemory();
+  return total;
+}
+
+#define INFLATE_WINDOW (64 * 1024)
+
+/* A gzip or zlib stream the parser pulls from through a window that only
+   has to hold the largest single string or array, not the whole document. */
+struct InflateSource {
+  z_stream stream;
+  const uint8_t *src;
+  size_t length;
+  ScratchBuffer *window;
+  int done;
+};
+
+/* zlib window bits for gzip or zlib framing, or 0 for neither. */
+static int compression_bits(const uint8_t *src, size_t length) {
+  if (length >= 2 && src[0] == 0x1f && src[1] == 0x8b)
+    return 15 + 16;
+  if (length >= 2 && (src[0] & 0x0f) == 8 && (src[0] << 8 | src[1]) % 31 == 0)
+    return 15;
+  return 0;
+}
+
+static int source_init(InflateSource *source, const uint8_t *src,
+                       size_t length, ScratchBuffer *window) {
+  int bits = compression_bits(src, length);
+  if (!bits) {
+    PyErr_SetString(PyExc_ValueError, "Data is neither gzip nor zlib");
+    return -1;
+  }
+
+  if (scratch_reserve(window, INFLATE_WINDOW) < 0)
+    return -1;
+
+  memset(source, 0, sizeof(*source));
+  if (inflateInit2(&source->stream, bits) != Z_OK) {
+    PyErr_SetString(PyExc_ValueError, "Could not initialize zlib");
+    return -1;
+  }
+  source->stream.next_in = (Bytef *)src;
+  source->src = src;
+  source->length = length;
+  source->window = window;
+  return 0;
+}
+
+/* Moves the unread bytes to the front of the window and inflates until at
+   least count bytes are available or the stream ends; running short at the
+   end is left to need() to report. count comes from length prefixes in the
+   data, so the window only doubles once inflated bytes have filled it. */
+static int source_fill(NBTParser *parser, size_t count) {
+  InflateSource *source = parser->source;
+  ScratchBuffer *window = source->window;
+  size_t avail = parser->length - parser->pos;
+  memmove(window->data, window->data + parser->pos, avail);
+  parser->data = window->data;
+  parser->pos = 0;
+  parser->length = avail;
+
+  z_stream *stream = &source->stream;
+  while (parser->length < count && !source->done) {
+    if (parser->length == window->capacity) {
+      if (scratch_reserve(window, window->capacity * 2) < 0)
+        return -1;
+      parser->data = window->data;
+    }
+
+    size_t consumed = (size_t)((const uint8_t *)stream->next_in - source->src);
+    size_t in_left = source->length - consumed;
+    stream->avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+    size_t out_left = window->capacity - parser->length;
+    stream->avail_out = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+    stream->next_out = window->data + parser->length;
+
+    int status = inflate(stream, Z_NO_FLUSH);
+    parser->length = (size_t)(stream->next_out - window->data);
+
+    if (status == Z_STREAM_END) {
+      if (stream->avail_in >= 2 && stream->next_in[0] == 0x1f &&
+          stream->next_in[1] == 0x8b)
+        inflateReset(stream);
+      else
+        source->done = 1;
+      continue;
+    }
+
+    if (status == Z_BUF_ERROR && in_left == 0)
+      status = Z_DATA_ERROR;
+    if (status != Z_OK && status != Z_BUF_ERROR) {
+      PyErr_Format(PyExc_ValueError, "Invalid compressed data: %s",
+                   stream->msg ? stream->msg : "truncated stream");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Below this size a plain read is cheaper than setting up a mapping. */
+#define FILE_MAP_MIN (64 * 1024)
+
+typedef struct {
+  const uint8_t *data;
+  size_t length;
+  int mapped;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+} FileMap;
+
+/* Maps a str, bytes or os.PathLike path read-only (small files are read
+   into memory instead). Empty files give an empty buffer. */
+#ifdef _WIN32
+static int file_map(FileMap *map, PyObject *path) {
+  PyObject *decoded;
+  if (!PyUnicode_FSDecoder(path, &decoded))
+    return -1;
+  wchar_t *wide = PyUnicode_AsWideCharString(decoded, NULL);
+  if (!wide) {
+    Py_DECREF(decoded);
+    return -1;
+  }
+
+  HANDLE file = CreateFileW(wide, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  PyMem_Free(wide);
+  LARGE_INTEGER size;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+    PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError, 0, decoded);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    Py_DECREF(decoded);
+    return -1;
+  }
+
+  map->data = NULL;
+  map->length = (size_t)size.QuadPart;
+  map->mapped = map->length >= FILE_MAP_MIN;
+  map->mapping = NULL;
+  int status = 0;
+  if (map->mapped) {
+    map->mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    map->data = map->mapping ? MapViewOfFile(map->mapping, FILE_MAP_READ, 0,
+                                             0, 0)
+                             : NULL;
+    if (!map->data) {
+      PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError, 0,
+                                                   decoded);
+      if (map->mapping)
+        CloseHandle(map->mapping);
+      status = -1;
+    }
+  } else if (map->length) {
+    uint8_t *data = PyMem_RawMalloc(map->length);
+    DWORD got = 0;
+    if (!data || !ReadFile(file, data, (DWORD)map->length, &got, NULL) ||
+        got != map->length) {
+      if (!data)
+        PyErr_NoMemory();
+      else
+        PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError, 0,
+                                                     decoded);
+      PyMem_RawFree(data);
+      status = -1;
+    } else {
+      map->data = data;
+    }
+  }
+  CloseHandle(file);
+  Py_DECREF(decoded);
+  return status;
+}
+
+static void file_unmap(FileMap *map) {
+  if (!map->mapped) {
+    PyMem_RawFree((void *)map->data);
+    return;
+  }
+  if (map->data)
+    UnmapViewOfFile(map->data);
+  if (map->mapping)
+    CloseHandle(map->mapping);
+}
+#else
+static int file_map(FileMap *map, PyObject *path) {
+  PyObject *encoded;
+  if (!PyUnicode_FSConverter(path, &encoded))
+    return -1;
+
+  int fd = open(PyBytes_AS_STRING(encoded), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    if (fd >= 0)
+      close(fd);
+    Py_DECREF(encoded);
+    return -1;
+  }
+
+  map->data = NULL;
+  map->length = (size_t)info.st_size;
+  map->mapped = map->length >= FILE_MAP_MIN;
+  int status = 0;
+  if (map->mapped) {
+    void *data = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+      status = -1;
+    } else {
+#ifdef MADV_SEQUENTIAL
+      madvise(data, map->length, MADV_SEQUENTIAL);
+#endif
+      map->data = data;
+    }
+  } else if (map->length) {
+    uint8_t *data = PyMem_RawMalloc(map->length);
+    ssize_t got = data ? read(fd, data, map->length) : -1;
+    if (got != (ssize_t)map->length) {
+      if (!data)
+        PyErr_NoMemory();
+      else
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+      PyMem_RawFree(data);
+      status = -1;
+    } else {
+      map->data = data;
+    }
+  }
+  close(fd);
+  Py_DECREF(encoded);
+  return status;
+}
+
+static void file_unmap(FileMap *map) {
+  if (map->mapped && map->data)
+    munmap((void *)map->data, map->length);
+  else
+    PyMem_RawFree((void *)map->data);
+}
+#endif
+
+#define TAPE_NO_NAME SIZE_MAX
+
+enum { TAPE_OK, TAPE_INVALID, TAPE_NO_MEMORY };
+
+typedef struct {
+  size_t offset;
+  size_t name;
+  uint32_t count;
+  uint32_t next;
+  uint8_t type;
+  uint8_t elem_type;
+} TapeEntry;
+
+typedef struct {
+  TapeEntry *entries;
+  size_t length;
+  size_t capacity;
+  int status;
+  char error[64];
+} Tape;
+
+typedef struct {
+  const uint8_t *data;
+  size_t pos;
+  size_t length;
+  Tape *tape;
+  int little_endian;
+  int max_depth;
+  int nameless_root;
+} TapeBuilder;
+
+static void tape_builder_init(TapeBuilder *builder, const uint8_t *data,
+                              size_t length, Tape *tape,
+                              const ParseOptions *options) {
+  builder->data = data;
+  builder->pos = 0;
+  builder->length = length;
+  builder->tape = tape;
+  builder->little_endian = options->little_endian;
+  builder->max_depth = options->max_depth;
+  builder->nameless_root = options->nameless_root;
+}
+
+static void tape_free(Tape *tape) {
+  PyMem_RawFree(tape->entries);
+  tape->entries = NULL;
+  tape->length = tape->capacity = 0;
+}
+
+static int tape_fail(TapeBuilder *builder, const char *format, int value) {
+  builder->tape->status = TAPE_INVALID;
+  snprintf(builder->tape->error, sizeof(builder->tape->error), format, value);
+  return -1;
+}
+
+static int tape_need(TapeBuilder *builder, size_t count) {
+  if (builder->pos + count > builder->length)
+    return tape_fail(builder, "Unexpected end of data", 0);
+  return 0;
+}
+
+static int tape_read_byte(TapeBuilder *builder, uint8_t *out) {
+  if (tape_need(builder, 1) < 0)
+    return -1;
+  *out = builder->data[builder->pos++];
+  return 0;
+}
+
+static int tape_read_size(TapeBuilder *builder, uint16_t *out) {
+  uint16_t val;
+  if (tape_need(builder, 2) < 0)
+    return -1;
+  memcpy(&val, builder->data + builder->pos, 2);
+  builder->pos += 2;
+  *out = builder->little_endian ? val : swap16(val);
+  return 0;
+}
+
+static int tape_read_int(TapeBuilder *builder, int32_t *out) {
+  uint32_t val;
+  if (tape_need(builder, 4) < 0)
+    return -1;
+  memcpy(&val, builder->data + builder->pos, 4);
+  builder->pos += 4;
+  *out = (int32_t)(builder->little_endian ? val : swap32(val));
+  return 0;
+}
+
+static int tape_push(TapeBuilder *builder, uint8_t type, size_t name,
+                     size_t *index) {
+  Tape *tape = builder->tape;
+  if (tape->length == tape->capacity) {
+    size_t capacity = tape->capacity ? tape->capacity * 2 : 64;
+    if (capacity > UINT32_MAX)
+      return tape_fail(builder, "Data too large", 0);
+    TapeEntry *entries =
+        PyMem_RawRealloc(tape->entries, capacity * sizeof(TapeEntry));
+    if (!entries) {
+      tape->status = TAPE_NO_MEMORY;
+      return -1;
+    }
+    tape->entries = entries;
+    tape->capacity = capacity;
+  }
+
+  *index = tape->length++;
+  TapeEntry *entry = &tape->entries[*index];
+  entry->offset = builder->pos;
+  entry->name = name;
+  entry->count = 0;
+  entry->type = type;
+  entry->elem_type = TAG_END;
+  return 0;
+}
+
+static uint8_t array_elem_type(uint8_t tag_type) {
+  switch (tag_type) {
+  case TAG_BYTE_ARRAY:
+    return TAG_BYTE;
+  case TAG_INT_ARRAY:
+    return TAG_INT;
+  case TAG_LONG_ARRAY:
+    return TAG_LONG;
+  default:
+    return TAG_END;
+  }
+}
+
+#define WALK_STACK_INLINE 32
+
+/* An open list or compound of the tape builder and skip engine: the tape
+   entry of the container, the list elements still to come and the
+   compound children seen so far. */
+typedef struct {
+  size_t index;
+  uint32_t remaining;
+  uint32_t children;
+  uint8_t kind;
+  uint8_t elem_type;
+} WalkFrame;
+
+typedef struct {
+  WalkFrame *frames;
+  int depth;
+  int capacity;
+  WalkFrame small[WALK_STACK_INLINE];
+} WalkStack;
+
+static void walk_init(WalkStack *stack) {
+  stack->frames = stack->small;
+  stack->depth = 0;
+  stack->capacity = WALK_STACK_INLINE;
+}
+
+static void walk_free(WalkStack *stack) {
+  if (stack->frames != stack->small)
+    PyMem_RawFree(stack->frames);
+}
+
+/* Opens a non-empty container at the given document depth. Like the
+   decoder's stack_push, it fails once the depth reaches max_depth. Safe
+   without the GIL. */
+static WalkFrame *walk_push(TapeBuilder *builder, WalkStack *stack,
+                            int depth, uint8_t kind) {
+  if (depth >= builder->max_depth) {
+    tape_fail(builder, "Maximum nesting depth of %d exceeded",
+              builder->max_depth);
+    return NULL;
+  }
+
+  if (stack->depth == stack->capacity) {
+    size_t size = (size_t)stack->capacity * 2 * sizeof(WalkFrame);
+    WalkFrame *frames = stack->frames == stack->small
+                            ? PyMem_RawMalloc(size)
+                            : PyMem_RawRealloc(stack->frames, size);
+    if (!frames) {
+      builder->tape->status = TAPE_NO_MEMORY;
+      return NULL;
+    }
+    if (stack->frames == stack->small)
+      memcpy(frames, stack->small, sizeof(stack->small));
+    stack->frames = frames;
+    stack->capacity *= 2;
+  }
+
+  WalkFrame *frame = &stack->frames[stack->depth++];
+  frame->kind = kind;
+  frame->remaining = 0;
+  frame->children = 0;
+  return frame;
+}
+
+/* Reads the header of a list, checking its length and element type. */
+static int tape_read_list(TapeBuilder *builder, uint8_t *elem_type,
+                          int32_t *length) {
+  if (tape_read_byte(builder, elem_type) < 0 ||
+      tape_read_int(builder, length) < 0)
+    return -1;
+  if (*length < 0)
+    return tape_fail(builder, "Invalid list length: %d", *length);
+  if (*elem_type == TAG_END && *length != 0)
+    return tape_fail(builder,
+                     "List has element type TAG_End but non-zero length", 0);
+  return 0;
+}
+
+/* Skips a string, or the elements of a byte, int or long array. */
+static int tape_skip_sized(TapeBuilder *builder, uint8_t tag_type,
+                           uint32_t *count) {
+  if (tag_type == TAG_STRING) {
+    uint16_t length;
+    if (tape_read_size(builder, &length) < 0 || tape_need(builder, length) < 0)
+      return -1;
+    builder->pos += length;
+    *count = length;
+    return 0;
+  }
+
+  int32_t length;
+  if (tape_read_int(builder, &length) < 0)
+    return -1;
+  if (length < 0)
+    return tape_fail(builder, "Invalid array length: %d", length);
+
+  size_t size = fixed_payload_size(array_elem_type(tag_type));
+  if (tape_need(builder, (size_t)length * size) < 0)
+    return -1;
+  builder->pos += (size_t)length * size;
+  *count = (uint32_t)length;
+  return 0;
+}
+
+/* Reads the next child header of a compound; returns 1 at TAG_End. */
+static int tape_read_child(TapeBuilder *builder, uint8_t *child_tag,
+                           size_t *name) {
+  uint16_t name_length;
+  if (tape_read_byte(builder, child_tag) < 0)
+    return -1;
+  if (*child_tag == TAG_END)
+    return 1;
+
+  *name = builder->pos;
+  if (tape_read_size(builder, &name_length) < 0 ||
+      tape_need(builder, name_length) < 0)
+    return -1;
+  builder->pos += name_length;
+  return 0;
+}
+
+/* Records one entry per tag, in document order, with an explicit stack so
+   hostile nesting cannot exhaust the C stack of a worker thread. */
+static int tape_build_payload(TapeBuilder *builder, uint8_t tag_type,
+                              size_t name) {
+  Tape *tape = builder->tape;
+  WalkStack stack;
+  WalkFrame *frame;
+  walk_init(&stack);
+  int status = -1;
+
+  for (;;) {
+    if (tag_type == TAG_TBD && tape_read_byte(builder, &tag_type) < 0)
+      goto done;
+
+    size_t index;
+    if (tape_push(builder, tag_type, name, &index) < 0)
+      goto done;
+
+    switch (tag_type) {
+    case TAG_END:
+      break;
+
+    case TAG_BYTE:
+    case TAG_SHORT:
+    case TAG_INT:
+    case TAG_LONG:
+    case TAG_FLOAT:
+    case TAG_DOUBLE: {
+      size_t size = fixed_payload_size(tag_type);
+      if (tape_need(builder, size) < 0)
+        goto done;
+      builder->pos += size;
+      break;
+    }
+
+    case TAG_STRING:
+    case TAG_BYTE_ARRAY:
+    case TAG_INT_ARRAY:
+    case TAG_LONG_ARRAY:
+      if (tape_skip_sized(builder, tag_type, &tape->entries[index].count) < 0)
+        goto done;
+      break;
+
+    case TAG_LIST: {
+      uint8_t elem_type;
+      int32_t length;
+      if (tape_read_list(builder, &elem_type, &length) < 0)
+        goto done;
+      tape->entries[index].elem_type = elem_type;
+      tape->entries[index].count = (uint32_t)length;
+
+      size_t size = fixed_payload_size(elem_type);
+      if (size) {
+        if (tape_need(builder, (size_t)length * size) < 0)
+          goto done;
+        builder->pos += (size_t)length * size;
+        break;
+      }
+      if (length == 0)
+        break;
+
+      if (!(frame = walk_push(builder, &stack, stack.depth, TAG_LIST)))
+        goto done;
+      frame->index = index;
+      frame->elem_type = elem_type;
+      frame->remaining = (uint32_t)length;
+      goto next;
+    }
+
+    case TAG_COMPOUND:
+      if (tape_need(builder, 1) < 0)
+        goto done;
+      if (builder->data[builder->pos] == TAG_END) {
+        builder->pos++;
+        break;
+      }
+      if (!(frame = walk_push(builder, &stack, stack.depth, TAG_COMPOUND)))
+        goto done;
+      frame->index = index;
+      goto next;
+
+    default:
+      tape_fail(builder, "Unknown tag type: %d", tag_type);
+      goto done;
+    }
+    tape->entries[index].next = (uint32_t)tape->length;
+
+  next:
+    for (;;) {
+      if (stack.depth == 0) {
+        status = 0;
+        goto done;
+      }
+
+      frame = &stack.frames[stack.depth - 1];
+      if (frame->kind == TAG_LIST) {
+        if (frame->remaining > 0) {
+          frame->remaining--;
+          tag_type = frame->elem_type;
+          name = TAPE_NO_NAME;
+          break;
+        }
+      } else {
+        int end = tape_read_child(builder, &tag_type, &name);
+        if (end < 0)
+          goto done;
+        if (!end) {
+          frame->children++;
+          break;
+        }
+        tape->entries[frame->index].count = frame->children;
+      }
+      tape->entries[frame->index].next = (uint32_t)tape->length;
+      stack.depth--;
+    }
+  }
+
+done:
+  walk_free(&stack);
+  return status;
+}
+
+/* Reads the root tag type and steps over its name, if it has one. */
+static int tape_read_root(TapeBuilder *builder, uint8_t *root_type) {
+  uint16_t name_length;
+  if (tape_read_byte(builder, root_type) < 0)
+    return -1;
+  if (builder->nameless_root)
+    return 0;
+  if (tape_read_size(builder, &name_length) < 0 ||
+      tape_need(builder, name_length) < 0)
+    return -1;
+  builder->pos += name_length;
+  return 0;
+}
+
+/* Indexes data with the byte order and depth limit of options; the tape
+   walks fixed-width lengths only, so options->varint must be clear. */
+static int tape_build(Tape *tape, const uint8_t *data, size_t length,
+                      const ParseOptions *options) {
+  TapeBuilder builder;
+  tape_builder_init(&builder, data, length, tape, options);
+  tape->length = 0;
+  tape->status = TAPE_OK;
+  tape->error[0] = '\0';
+
+  uint8_t root_type;
+  if (tape_read_root(&builder, &root_type) < 0)
+    return -1;
+  return tape_build_payload(&builder, root_type, TAPE_NO_NAME);
+}
+
+/* Advances past one value at the given document depth without decoding
+   it. Strings, arrays and lists of fixed-size scalars are skipped from
+   their length prefixes; lists and compounds are walked with an explicit
+   stack. */
+static int skip_tag_payload(TapeBuilder *builder, uint8_t tag_type,
+                            int depth) {
+  WalkStack stack;
+  WalkFrame *frame;
+  walk_init(&stack);
+  int status = -1;
+
+  for (;;) {
+    if (tag_type == TAG_TBD && tape_read_byte(builder, &tag_type) < 0)
+      goto done;
+
+    size_t size = fixed_payload_size(tag_type);
+    uint32_t count;
+    if (size) {
+      if (tape_need(builder, size) < 0)
+        goto done;
+      builder->pos += size;
+    } else {
+      switch (tag_type) {
+      case TAG_END:
+        break;
+
+      case TAG_STRING:
+      case TAG_BYTE_ARRAY:
+      case TAG_INT_ARRAY:
+      case TAG_LONG_ARRAY:
+        if (tape_skip_sized(builder, tag_type, &count) < 0)
+          goto done;
+        break;
+
+      case TAG_LIST: {
+        uint8_t elem_type;
+        int32_t length;
+        if (tape_read_list(builder, &elem_type, &length) < 0)
+          goto done;
+
+        size = fixed_payload_size(elem_type);
+        if (size) {
+          if (tape_need(builder, (size_t)length * size) < 0)
+            goto done;
+          builder->pos += (size_t)length * size;
+          break;
+        }
+        if (length == 0)
+          break;
+
+        if (!(frame = walk_push(builder, &stack, depth + stack.depth,
+                                TAG_LIST)))
+          goto done;
+        if (elem_type == TAG_STRING) {
+          for (int32_t i = 0; i < length; i++) {
+            if (tape_skip_sized(builder, TAG_STRING, &count) < 0)
+              goto done;
+          }
+          break;
+        }
+        frame->elem_type = elem_type;
+        frame->remaining = (uint32_t)length;
+        break;
+      }
+
+      case TAG_COMPOUND:
+        if (tape_need(builder, 1) < 0)
+          goto done;
+        if (builder->data[builder->pos] == TAG_END) {
+          builder->pos++;
+          break;
+        }
+        if (!walk_push(builder, &stack, depth + stack.depth, TAG_COMPOUND))
+          goto done;
+        break;
+
+      default:
+        tape_fail(builder, "Unknown tag type: %d", tag_type);
+        goto done;
+      }
+    }
+
+    for (;;) {
+      if (stack.depth == 0) {
+        status = 0;
+        goto done;
+      }
+
+      frame = &stack.frames[stack.depth - 1];
+      if (frame->kind == TAG_LIST) {
+        if (frame->remaining > 0) {
+          frame->remaining--;
+          tag_type = frame->elem_type;
+          break;
+        }
+      } else {
+        size_t name;
+        int end = tape_read_child(builder, &tag_type, &name);
+        if (end < 0)
+          goto done;
+        if (!end)
+          break;
+      }
+      stack.depth--;
+    }
+  }
+
+done:
+  walk_free(&stack);
+  return status;
+}
+
+static int skip_root(TapeBuilder *builder) {
+  uint8_t root_type;
+  if (tape_read_root(builder, &root_type) < 0)
+    return -1;
+  return skip_tag_payload(builder, root_type, 0);
+}
+
+static int tape_set_error(const Tape *tape) {
+  if (tape->status == TAPE_NO_MEMORY)
+    PyErr_NoMemory();
+  else
+    PyErr_SetString(PyExc_ValueError, tape->error);
+  return -1;
+}
+
+static PyObject *lazy_compound_new(PyObject *view, size_t offset,
+                                   const NBTParser *parser, int depth);
+
+/* Returns the key of a compound's next child, taking it from the shape
+   predicted by the first key when the name matches, as the one-pass decoder
+   does in read_child_header. */
+static PyObject *materialize_key(NBTParser *parser, size_t name, Shape **shape,
+                                 int *hit, Py_ssize_t index) {
+  const uint8_t *data;
+  size_t length;
+  parser->pos = name;
+  if (read_key_bytes(parser, &data, &length) < 0)
+    return NULL;
+
+  if (index == 0) {
+    PyObject *key = key_cache_get(parser->cache, data, length);
+    if (key) {
+      *shape = shape_slot(parser->cache, key);
+      *hit = (*shape)->count > 0 && (*shape)->keys[0] == key;
+    }
+    return key;
+  }
+
+  if (*hit && index < (*shape)->count &&
+      (size_t)(*shape)->lengths[index] == length &&
+      memcmp((*shape)->names[index], data, length) == 0) {
+    Py_INCREF((*shape)->keys[index]);
+    return (*shape)->keys[index];
+  }
+  *hit = 0;
+  return key_cache_get(parser->cache, data, length);
+}
+
+/* The tape has already checked every bound, so lists of fixed-size scalars
+   are decoded as one run and the other leaves are loaded directly instead
+   of going through the decoder loop. */
+static PyObject *materialize_entry(NBTParser *parser, const TapeEntry *entries,
+                                   size_t index) {
+  const TapeEntry *entry = &entries[index];
+  parser->pos = entry->offset;
+
+  switch (entry->type) {
+  case TAG_BYTE:
+  case TAG_SHORT:
+  case TAG_INT:
+  case TAG_LONG:
+  case TAG_FLOAT:
+  case TAG_DOUBLE:
+    return load_scalar(parser, entry->type);
+
+  case TAG_STRING:
+    return read_string(parser);
+
+  case TAG_LIST: {
+    if (fixed_payload_size(entry->elem_type)) {
+      parser->pos += 5;
+      return read_scalar_list(parser, entry->elem_type, (int32_t)entry->count);
+    }
+
+    PyObject *list = PyList_New(entry->count);
+    if (!list)
+      return NULL;
+
+    size_t child = index + 1;
+    for (uint32_t i = 0; i < entry->count; i++) {
+      PyObject *item = materialize_entry(parser, entries, child);
+      if (!item) {
+        Py_DECREF(list);
+        return NULL;
+      }
+      PyList_SET_ITEM(list, i, item);
+      child = entries[child].next;
+    }
+    return list;
+  }
+
+  case TAG_COMPOUND: {
+    /* tapes are checked against the depth limit as they are built, so
+       proxies made from them cannot exceed it whatever depth they get */
+    if (parser->lazy_view)
+      return lazy_compound_new(parser->lazy_view, entry->offset, parser, 0);
+
+    PyObject *dict = dict_new_presized(entry->count);
+    if (!dict)
+      return NULL;
+
+    Shape *shape = NULL;
+    int hit = 0;
+    Py_ssize_t i = 0;
+    for (size_t child = index + 1; child < entry->next;
+         child = entries[child].next, i++) {
+      PyObject *key =
+          materialize_key(parser, entries[child].name, &shape, &hit, i);
+      if (!key) {
+        Py_DECREF(dict);
+        return NULL;
+      }
+
+      PyObject *value = materialize_entry(parser, entries, child);
+      int status = value ? PyDict_SetItem(dict, key, value) : -1;
+      Py_DECREF(key);
+      Py_XDECREF(value);
+      if (status < 0) {
+        Py_DECREF(dict);
+        return NULL;
+      }
+    }
+
+    if (shape && hit && i == shape->count) {
+      parser->cache->shape_hits++;
+    } else if (shape) {
+      parser->cache->shape_misses++;
+      shape_store(shape, dict);
+    }
+    return dict;
+  }
+
+  default:
+    return read_tag_payload(parser, entry->type);
+  }
+}
+
+static PyObject *materialize_tape(const Tape *tape, size_t index,
+                                  NBTParser *parser) {
+  return materialize_entry(parser, tape->entries, index);
+}
+
+#ifdef _WIN32
+typedef HANDLE nbt_thread_t;
+#define NBT_THREAD_FUNC DWORD WINAPI
+#define NBT_THREAD_RETURN 0
+
+static int thread_start(nbt_thread_t *thread,
+                        LPTHREAD_START_ROUTINE func, void *arg) {
+  *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  return *thread ? 0 : -1;
+}
+
+static void thread_join(nbt_thread_t thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+static size_t atomic_next(volatile size_t *counter) {
+  return (size_t)InterlockedIncrement64((volatile LONG64 *)counter) - 1;
+}
+
+static void atomic_set(volatile size_t *counter, size_t value) {
+  InterlockedExchange64((volatile LONG64 *)counter, (LONG64)value);
+}
+
+static int cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+}
+
+typedef CRITICAL_SECTION nbt_mutex_t;
+typedef CONDITION_VARIABLE nbt_cond_t;
+
+static void sync_init(nbt_mutex_t *mutex, nbt_cond_t *a, nbt_cond_t *b) {
+  InitializeCriticalSection(mutex);
+  InitializeConditionVariable(a);
+  if (b)
+    InitializeConditionVariable(b);
+}
+
+static void sync_destroy(nbt_mutex_t *mutex, nbt_cond_t *a, nbt_cond_t *b) {
+  DeleteCriticalSection(mutex);
+}
+
+#define mutex_lock EnterCriticalSection
+#define mutex_unlock LeaveCriticalSection
+#define cond_signal WakeConditionVariable
+#define cond_broadcast WakeAllConditionVariable
+
+static void cond_wait(nbt_cond_t *cond, nbt_mutex_t *mutex) {
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+#else
+typedef pthread_t nbt_thread_t;
+#define NBT_THREAD_FUNC void *
+#define NBT_THREAD_RETURN NULL
+
+static int thread_start(nbt_thread_t *thread, void *(*func)(void *),
+                        void *arg) {
+  return pthread_create(thread, NULL, func, arg) == 0 ? 0 : -1;
+}
+
+static void thread_join(nbt_thread_t thread) { pthread_join(thread, NULL); }
+
+static size_t atomic_next(volatile size_t *counter) {
+  return __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void atomic_set(volatile size_t *counter, size_t value) {
+  __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static int cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+typedef pthread_mutex_t nbt_mutex_t;
+typedef pthread_cond_t nbt_cond_t;
+
+static void sync_init(nbt_mutex_t *mutex, nbt_cond_t *a, nbt_cond_t *b) {
+  pthread_mutex_init(mutex, NULL);
+  pthread_cond_init(a, NULL);
+  if (b)
+    pthread_cond_init(b, NULL);
+}
+
+static void sync_destroy(nbt_mutex_t *mutex, nbt_cond_t *a, nbt_cond_t *b) {
+  if (b)
+    pthread_cond_destroy(b);
+  pthread_cond_destroy(a);
+  pthread_mutex_destroy(mutex);
+}
+
+#define mutex_lock pthread_mutex_lock
+#define mutex_unlock pthread_mutex_unlock
+#define cond_signal pthread_cond_signal
+#define cond_broadcast pthread_cond_broadcast
+#define cond_wait pthread_cond_wait
+#endif
+
+typedef struct {
+  Py_buffer view;
+  Tape tape;
+} ParseJob;
+
+/* Buffers whose tapes the workers build without the GIL. Finished indices
+   are queued in done[] so the calling thread can materialize each buffer
+   while the others are still being indexed. */
+typedef struct {
+  ParseJob *jobs;
+  size_t count;
+  const ParseOptions *options;
+  volatile size_t next;
+  size_t *done;
+  size_t finished;
+  size_t consumed;
+  nbt_mutex_t lock;
+  nbt_cond_t ready;
+  nbt_thread_t *threads;
+  int thread_count;
+} JobQueue;
+
+static NBT_THREAD_FUNC parse_worker(void *arg) {
+  JobQueue *queue = arg;
+  size_t i;
+  while ((i = atomic_next(&queue->next)) < queue->count) {
+    ParseJob *job = &queue->jobs[i];
+    tape_build(&job->tape, job->view.buf, (size_t)job->view.len,
+               queue->options);
+
+    mutex_lock(&queue->lock);
+    queue->done[queue->finished++] = i;
+    cond_signal(&queue->ready);
+    mutex_unlock(&queue->lock);
+  }
+  return NBT_THREAD_RETURN;
+}
+
+/* Starts up to threads workers. If none can be started, the tapes are
+   built on the calling thread up front. */
+static int queue_start(JobQueue *queue, int threads) {
+  queue->done = PyMem_Malloc(queue->count * sizeof(size_t));
+  queue->threads = PyMem_RawMalloc((size_t)threads * sizeof(nbt_thread_t));
+  if (!queue->done || !queue->threads) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  sync_init(&queue->lock, &queue->ready, NULL);
+
+  for (; queue->thread_count < threads; queue->thread_count++) {
+    if (thread_start(&queue->threads[queue->thread_count], parse_worker,
+                     queue) < 0)
+      break;
+  }
+  if (!queue->thread_count) {
+    Py_BEGIN_ALLOW_THREADS
+    parse_worker(queue);
+    Py_END_ALLOW_THREADS
+  }
+  return 0;
+}
+
+/* Returns the index of the next finished tape, waiting without the GIL
+   only when none is ready yet. */
+static size_t queue_take(JobQueue *queue) {
+  mutex_lock(&queue->lock);
+  if (queue->finished == queue->consumed) {
+    mutex_unlock(&queue->lock);
+    Py_BEGIN_ALLOW_THREADS
+    mutex_lock(&queue->lock);
+    while (queue->finished == queue->consumed)
+      cond_wait(&queue->ready, &queue->lock);
+    mutex_unlock(&queue->lock);
+    Py_END_ALLOW_THREADS
+    mutex_lock(&queue->lock);
+  }
+  size_t i = queue->done[queue->consumed++];
+  mutex_unlock(&queue->lock);
+  return i;
+}
+
+/* Lets the workers stop after their current tape and joins them. */
+static void queue_stop(JobQueue *queue) {
+  if (!queue->done || !queue->threads)
+    goto release;
+
+  atomic_set(&queue->next, queue->count);
+  Py_BEGIN_ALLOW_THREADS
+  for (int i = 0; i < queue->thread_count; i++)
+    thread_join(queue->threads[i]);
+  Py_END_ALLOW_THREADS
+  sync_destroy(&queue->lock, &queue->ready, NULL);
+
+release:
+  PyMem_RawFree(queue->threads);
+  PyMem_Free(queue->done);
+}
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *source;
+  Py_buffer view;
+  Tape tape;
+  ParseOptions options;
+} TapeObject;
+
+static PyTypeObject TapeType;
+
+static PyObject *Tape_new(PyTypeObject *type, PyObject *args,
+                          PyObject *kwargs) {
+  static char *kwlist[] = {"data", OPTION_NAMES, NULL};
+  PyObject *source, *values[OPTION_COUNT] = {NULL};
+  ParseOptions options;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|" OPTION_FORMAT, kwlist,
+                                   &source, OPTION_TARGETS(values)) ||
+      parse_options("Tape", values, NO_VARINT, &options) < 0)
+    return NULL;
+
+  TapeObject *self = (TapeObject *)type->tp_alloc(type, 0);
+  if (!self)
+    return NULL;
+  self->options = options;
+
+  if (PyObject_GetBuffer(source, &self->view, PyBUF_SIMPLE) < 0) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  Py_INCREF(source);
+  self->source = source;
+
+  int status;
+  Py_BEGIN_ALLOW_THREADS
+  status = tape_build(&self->tape, self->view.buf, (size_t)self->view.len,
+                      &self->options);
+  Py_END_ALLOW_THREADS
+
+  if (status < 0) {
+    tape_set_error(&self->tape);
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+static void Tape_dealloc(TapeObject *self) {
+  if (self->source) {
+    PyBuffer_Release(&self->view);
+    Py_DECREF(self->source);
+  }
+  tape_free(&self->tape);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static Py_ssize_t Tape_length(TapeObject *self) {
+  return (Py_ssize_t)self->tape.length;
+}
+
+static PyObject *Tape_item(TapeObject *self, Py_ssize_t index) {
+  if (index < 0 || (size_t)index >= self->tape.length) {
+    PyErr_SetString(PyExc_IndexError, "tape index out of range");
+    return NULL;
+  }
+  const TapeEntry *entry = &self->tape.entries[index];
+  return Py_BuildValue("(innI)", entry->type, (Py_ssize_t)entry->offset,
+                       (Py_ssize_t)entry->count, entry->next);
+}
+
+static int tape_find_child(const TapeObject *self, size_t *index,
+                           const NameKey *key) {
+  const TapeEntry *entries = self->tape.entries;
+  const uint8_t *data = self->view.buf;
+
+  if (entries[*index].type != TAG_COMPOUND)
+    return 0;
+
+  for (size_t child = *index + 1; child < entries[*index].next;
+       child = entries[child].next) {
+    const uint8_t *name = data + entries[child].name;
+    Py_ssize_t name_length = self->options.little_endian
+                                 ? name[1] << 8 | name[0]
+                                 : name[0] << 8 | name[1];
+    if (name_key_match(key, name + 2, name_length)) {
+      *index = child;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int tape_find_key(const TapeObject *self, size_t *index,
+                         PyObject *key) {
+  NameKey name;
+  char small[MUTF8_SMALL], *heap;
+  if (name_key_init(&name, key, small, &heap) < 0)
+    return -1;
+
+  int found = tape_find_child(self, index, &name);
+  PyMem_Free(heap);
+  if (!found) {
+    PyErr_SetObject(PyExc_KeyError, key);
+    return -1;
+  }
+  return 0;
+}
+
+static int tape_resolve(const TapeObject *self, PyObject *path, size_t *index,
+                        Py_ssize_t *element) {
+  PyObject *seq =
+      PySequence_Fast(path, "path must be a sequence of keys and indices");
+  if (!seq)
+    return -1;
+
+  const TapeEntry *entries = self->tape.entries;
+  Py_ssize_t depth = PySequence_Fast_GET_SIZE(seq);
+  *index = 0;
+  *element = -1;
+
+  for (Py_ssize_t i = 0; i < depth; i++) {
+    PyObject *component = PySequence_Fast_GET_ITEM(seq, i);
+    const TapeEntry *entry = &entries[*index];
+
+    if (PyUnicode_Check(component)) {
+      if (tape_find_key(self, index, component) < 0)
+        goto fail;
+      continue;
+    }
+
+    if (!PyLong_Check(component)) {
+      PyErr_SetString(PyExc_TypeError,
+                      "path components must be str keys or int indices");
+      goto fail;
+    }
+
+    Py_ssize_t position = PyLong_AsSsize_t(component);
+    if (position == -1 && PyErr_Occurred())
+      goto fail;
+    if (position < 0)
+      position += entry->count;
+
+    int indexable = entry->type == TAG_LIST ||
+                    array_elem_type(entry->type) != TAG_END;
+    if (!indexable || position < 0 || position >= (Py_ssize_t)entry->count) {
+      PyErr_SetString(PyExc_IndexError, "path index out of range");
+      goto fail;
+    }
+
+    if (entry->type == TAG_LIST &&
+        fixed_payload_size(entry->elem_type) == 0) {
+      size_t child = *index + 1;
+      for (Py_ssize_t j = 0; j < position; j++)
+        child = entries[child].next;
+      *index = child;
+      continue;
+    }
+
+    if (i != depth - 1) {
+      PyErr_SetString(PyExc_IndexError, "path descends into a scalar");
+      goto fail;
+    }
+    *element = position;
+  }
+
+  Py_DECREF(seq);
+  return 0;
+
+fail:
+  Py_DECREF(seq);
+  return -1;
+}
+
+static PyObject *tape_materialize_at(TapeObject *self, size_t index,
+                                     Py_ssize_t element, int array_mode,
+                                     int lazy) {
+  const TapeEntry *entry = &self->tape.entries[index];
+  NBTParser parser;
+  parser_init(&parser, self->view.buf, (size_t)self->view.len);
+  parser_configure(&parser, &self->options, &default_cache);
+  parser.array_mode = array_mode;
+
+  if (element < 0 && lazy) {
+    parser.lazy_view = PyMemoryView_FromObject(self->source);
+    if (!parser.lazy_view)
+      return NULL;
+    PyObject *result = materialize_tape(&self->tape, index, &parser);
+    Py_DECREF(parser.lazy_view);
+    return result;
+  }
+
+  if (element < 0)
+    return materialize_tape(&self->tape, index, &parser);
+
+  uint8_t elem_type = entry->type == TAG_LIST ? entry->elem_type
+                                              : array_elem_type(entry->type);
+  size_t header = entry->type == TAG_LIST ? 5 : 4;
+  parser.pos = entry->offset + header +
+               (size_t)element * fixed_payload_size(elem_type);
+  return read_tag_payload(&parser, elem_type);
+}
+
+static PyObject *Tape_materialize(TapeObject *self, PyObject *args,
+                                  PyObject *kwargs) {
+  static char *kwlist[] = {"index", "arrays", "lazy", NULL};
+  Py_ssize_t index = 0;
+  const char *arrays = NULL;
+  int array_mode = self->options.array_mode, lazy = self->options.lazy;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n$sp", kwlist, &index,
+                                   &arrays, &lazy) ||
+      (arrays && parse_array_mode(arrays, &array_mode) < 0))
+    return NULL;
+  if (index < 0 || (size_t)index >= self->tape.length) {
+    PyErr_SetString(PyExc_IndexError, "tape index out of range");
+    return NULL;
+  }
+  return tape_materialize_at(self, (size_t)index, -1, array_mode, lazy);
+}
+
+static PyObject *Tape_find(TapeObject *self, PyObject *path) {
+  size_t index;
+  Py_ssize_t element;
+  if (tape_resolve(self, path, &index, &element) < 0)
+    return NULL;
+  if (element >= 0) {
+    PyErr_SetString(PyExc_IndexError,
+                    "elements of scalar lists and arrays have no tape entry");
+    return NULL;
+  }
+  return PyLong_FromSize_t(index);
+}
+
+static PyObject *Tape_get(TapeObject *self, PyObject *args,
+                          PyObject *kwargs) {
+  static char *kwlist[] = {"path", "default", "arrays", "lazy", NULL};
+  PyObject *path, *fallback = Py_None;
+  const char *arrays = NULL;
+  int array_mode = self->options.array_mode, lazy = self->options.lazy;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$sp", kwlist, &path,
+                                   &fallback, &arrays, &lazy) ||
+      (arrays && parse_array_mode(arrays, &array_mode) < 0))
+    return NULL;
+
+  size_t index;
+  Py_ssize_t element;
+  if (tape_resolve(self, path, &index, &element) < 0) {
+    if (!PyErr_ExceptionMatches(PyExc_LookupError))
+      return NULL;
+    PyErr_Clear();
+    Py_INCREF(fallback);
+    return fallback;
+  }
+  return tape_materialize_at(self, index, element, array_mode, lazy);
+}
+
+static PyMethodDef Tape_methods[] = {
+    {"materialize", (PyCFunction)(void (*)(void))Tape_materialize,
+     METH_VARARGS | METH_KEYWORDS,
+     "Builds the Python object for the entry at index (the root by default)"},
+    {"find", (PyCFunction)Tape_find, METH_O,
+     "Returns the tape index of the tag at a path of keys and indices"},
+    {"get", (PyCFunction)(void (*)(void))Tape_get,
+     METH_VARARGS | METH_KEYWORDS,
+     "Builds only the value at a path of keys and indices, or a default"},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef Tape_members[] = {
+    {"data", T_OBJECT, offsetof(TapeObject, source), READONLY,
+     "The buffer the tape indexes"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PySequenceMethods Tape_as_sequence = {
+    .sq_length = (lenfunc)Tape_length,
+    .sq_item = (ssizeargfunc)Tape_item,
+};
+
+static PyTypeObject TapeType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.Tape",
+    .tp_doc = "Tape(data, *, arrays='list', lazy=False, max_depth=512, "
+              "endian='big', nameless_root=False) is a flat structural index "
+              "of an NBT buffer. Entries are (tag_type, offset, count, next) "
+              "tuples where next is the index of the first entry after the "
+              "tag's subtree; arrays and lazy are the defaults of "
+              "materialize() and get()",
+    .tp_basicsize = sizeof(TapeObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Tape_new,
+    .tp_dealloc = (destructor)Tape_dealloc,
+    .tp_methods = Tape_methods,
+    .tp_members = Tape_members,
+    .tp_as_sequence = &Tape_as_sequence,
+};
+
+typedef struct {
+  uint8_t type;
+  size_t name;
+  size_t value;
+} LazyChild;
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *view;
+  size_t offset;
+  int array_mode;
+  int little_endian;
+  int max_depth;
+  int depth;
+  Py_ssize_t count;
+  LazyChild *children;
+  PyObject *cache;
+} LazyCompoundObject;
+
+static PyTypeObject LazyCompoundType;
+
+static PyObject *lazy_compound_new(PyObject *view, size_t offset,
+                                   const NBTParser *parser, int depth) {
+  LazyCompoundObject *self =
+      PyObject_New(LazyCompoundObject, &LazyCompoundType);
+  if (!self)
+    return NULL;
+
+  Py_INCREF(view);
+  self->view = view;
+  self->offset = offset;
+  self->array_mode = parser->array_mode;
+  self->little_endian = parser->little_endian;
+  self->max_depth = parser->max_depth;
+  self->depth = depth;
+  self->count = -1;
+  self->children = NULL;
+  self->cache = NULL;
+  return (PyObject *)self;
+}
+
+/* Checks the whole compound, including its depth, when the proxy is made,
+   so decoding its values later cannot fail. */
+static PyObject *read_lazy_compound(NBTParser *parser, int depth) {
+  Tape errors = {0};
+  TapeBuilder builder = {parser->data, parser->pos, parser->length, &errors,
+                         parser->little_endian, parser->max_depth};
+  if (skip_tag_payload(&builder, TAG_COMPOUND, depth) < 0) {
+    tape_set_error(&errors);
+    return NULL;
+  }
+
+  PyObject *result =
+      lazy_compound_new(parser->lazy_view, parser->pos, parser, depth);
+  parser->pos = builder.pos;
+  return result;
+}
+
+static void LazyCompound_dealloc(LazyCompoundObject *self) {
+  Py_XDECREF(self->cache);
+  PyMem_Free(self->children);
+  Py_DECREF(self->view);
+  PyObject_Free(self);
+}
+
+static void lazy_compound_parser(LazyCompoundObject *self,
+                                 NBTParser *parser) {
+  Py_buffer *view = PyMemoryView_GET_BUFFER(self->view);
+  parser_init(parser, view->buf, (size_t)view->len);
+  parser->array_mode = self->array_mode;
+  parser->little_endian = self->little_endian;
+  parser->max_depth = self->max_depth;
+  parser->base_depth = self->depth + 1;
+  parser->lazy_view = self->view;
+}
+
+static int lazy_compound_index(LazyCompoundObject *self) {
+  if (self->count >= 0)
+    return 0;
+
+  Py_buffer *view = PyMemoryView_GET_BUFFER(self->view);
+  Tape errors = {0};
+  TapeBuilder builder = {view->buf, self->offset, (size_t)view->len, &errors,
+                         self->little_endian, self->max_depth};
+  Py_ssize_t count = 0, capacity = 0;
+  LazyChild *children = NULL;
+
+  while (1) {
+    uint8_t child_tag;
+    uint16_t name_length;
+    if (tape_read_byte(&builder, &child_tag) < 0)
+      goto fail;
+    if (child_tag == TAG_END)
+      break;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 8;
+      LazyChild *grown = PyMem_Realloc(children, capacity * sizeof(LazyChild));
+      if (!grown) {
+        errors.status = TAPE_NO_MEMORY;
+        goto fail;
+      }
+      children = grown;
+    }
+
+    LazyChild *child = &children[count++];
+    child->type = child_tag;
+    child->name = builder.pos;
+    if (tape_read_size(&builder, &name_length) < 0 ||
+        tape_need(&builder, name_length) < 0)
+      goto fail;
+    builder.pos += name_length;
+    child->value = builder.pos;
+
+    if (skip_tag_payload(&builder, child_tag, self->depth + 1) < 0)
+      goto fail;
+  }
+
+  self->children = children;
+  self->count = count;
+  return 0;
+
+fail:
+  PyMem_Free(children);
+  return tape_set_error(&errors);
+}
+
+static PyObject *lazy_compound_key(LazyCompoundObject *self, Py_ssize_t i) {
+  NBTParser parser;
+  lazy_compound_parser(self, &parser);
+  parser.pos = self->children[i].name;
+  return read_key(&parser);
+}
+
+static Py_ssize_t lazy_compound_find(LazyCompoundObject *self,
+                                     PyObject *key) {
+  NameKey lookup;
+  char small[MUTF8_SMALL], *heap;
+  if (lazy_compound_index(self) < 0 ||
+      name_key_init(&lookup, key, small, &heap) < 0)
+    return -2;
+
+  const uint8_t *data = PyMemoryView_GET_BUFFER(self->view)->buf;
+  Py_ssize_t i = self->count - 1;
+  for (; i >= 0; i--) {
+    const uint8_t *name = data + self->children[i].name;
+    Py_ssize_t name_length = self->little_endian ? name[1] << 8 | name[0]
+                                                 : name[0] << 8 | name[1];
+    if (name_key_match(&lookup, name + 2, name_length))
+      break;
+  }
+  PyMem_Free(heap);
+  return i;
+}
+
+static PyObject *lazy_compound_value(LazyCompoundObject *self, Py_ssize_t i,
+                                     PyObject *key) {
+  if (self->cache) {
+    PyObject *value = PyDict_GetItemWithError(self->cache, key);
+    if (value) {
+      Py_INCREF(value);
+      return value;
+    }
+    if (PyErr_Occurred())
+      return NULL;
+  }
+
+  NBTParser parser;
+  lazy_compound_parser(self, &parser);
+  parser.pos = self->children[i].value;
+  PyObject *value = read_tag_payload(&parser, self->children[i].type);
+  if (!value)
+    return NULL;
+
+  if (!self->cache && !(self->cache = PyDict_New())) {
+    Py_DECREF(value);
+    return NULL;
+  }
+  if (PyDict_SetItem(self->cache, key, value) < 0) {
+    Py_DECREF(value);
+    return NULL;
+  }
+  return value;
+}
+
+static PyObject *lazy_compound_lookup(LazyCompoundObject *self, PyObject *key,
+                                      int raise) {
+  if (!PyUnicode_Check(key)) {
+    if (raise)
+      PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+
+  if (self->cache) {
+    PyObject *value = PyDict_GetItemWithError(self->cache, key);
+    if (value) {
+      Py_INCREF(value);
+      return value;
+    }
+    if (PyErr_Occurred())
+      return NULL;
+  }
+
+  Py_ssize_t i = lazy_compound_find(self, key);
+  if (i < 0) {
+    if (i == -1 && raise)
+      PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+  return lazy_compound_value(self, i, key);
+}
+
+static Py_ssize_t LazyCompound_length(LazyCompoundObject *self) {
+  if (lazy_compound_index(self) < 0)
+    return -1;
+  return self->count;
+}
+
+static PyObject *LazyCompound_subscript(LazyCompoundObject *self,
+                                        PyObject *key) {
+  return lazy_compound_lookup(self, key, 1);
+}
+
+static int LazyCompound_contains(LazyCompoundObject *self, PyObject *key) {
+  if (!PyUnicode_Check(key))
+    return 0;
+  Py_ssize_t i = lazy_compound_find(self, key);
+  return i == -2 ? -1 : i >= 0;
+}
+
+static PyObject *LazyCompound_keys(LazyCompoundObject *self,
+                                   PyObject *Py_UNUSED(ignored)) {
+  if (lazy_compound_index(self) < 0)
+    return NULL;
+
+  PyObject *keys = PyList_New(self->count);
+  if (!keys)
+    return NULL;
+
+  for (Py_ssize_t i = 0; i < self->count; i++) {
+    PyObject *key = lazy_compound_key(self, i);
+    if (!key) {
+      Py_DECREF(keys);
+      return NULL;
+    }
+    PyList_SET_ITEM(keys, i, key);
+  }
+  return keys;
+}
+
+static PyObject *lazy_compound_collect(LazyCompoundObject *self, int items) {
+  PyObject *keys = LazyCompound_keys(self, NULL);
+  if (!keys)
+    return NULL;
+
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++) {
+    PyObject *key = PyList_GET_ITEM(keys, i);
+    PyObject *value = lazy_compound_value(self, i, key);
+    if (!value) {
+      Py_DECREF(keys);
+      return NULL;
+    }
+    if (items) {
+      PyObject *pair = PyTuple_Pack(2, key, value);
+      Py_DECREF(value);
+      if (!pair) {
+        Py_DECREF(keys);
+        return NULL;
+      }
+      value = pair;
+    }
+    PyList_SET_ITEM(keys, i, value);
+    Py_DECREF(key);
+  }
+  return keys;
+}
+
+static PyObject *LazyCompound_values(LazyCompoundObject *self,
+                                     PyObject *Py_UNUSED(ignored)) {
+  return lazy_compound_collect(self, 0);
+}
+
+static PyObject *LazyCompound_items(LazyCompoundObject *self,
+                                    PyObject *Py_UNUSED(ignored)) {
+  return lazy_compound_collect(self, 1);
+}
+
+static PyObject *LazyCompound_get(LazyCompoundObject *self, PyObject *args) {
+  PyObject *key, *fallback = Py_None;
+  if (!PyArg_ParseTuple(args, "O|O", &key, &fallback))
+    return NULL;
+
+  PyObject *value = lazy_compound_lookup(self, key, 0);
+  if (!value && !PyErr_Occurred()) {
+    Py_INCREF(fallback);
+    return fallback;
+  }
+  return value;
+}
+
+static PyObject *LazyCompound_to_dict(LazyCompoundObject *self,
+                                      PyObject *Py_UNUSED(ignored)) {
+  NBTParser parser;
+  lazy_compound_parser(self, &parser);
+  parser.lazy_view = NULL;
+  parser.base_depth = self->depth;
+  parser.pos = self->offset;
+  return read_tag_payload(&parser, TAG_COMPOUND);
+}
+
+static PyObject *LazyCompound_iter(LazyCompoundObject *self) {
+  PyObject *keys = LazyCompound_keys(self, NULL);
+  if (!keys)
+    return NULL;
+  PyObject *iter = PyObject_GetIter(keys);
+  Py_DECREF(keys);
+  return iter;
+}
+
+static PyObject *LazyCompound_richcompare(PyObject *self, PyObject *other,
+                                          int op) {
+  if ((op != Py_EQ && op != Py_NE) || !PyDict_Check(other))
+    Py_RETURN_NOTIMPLEMENTED;
+
+  PyObject *dict = LazyCompound_to_dict((LazyCompoundObject *)self, NULL);
+  if (!dict)
+    return NULL;
+  PyObject *result = PyObject_RichCompare(dict, other, op);
+  Py_DECREF(dict);
+  return result;
+}
+
+static PyObject *LazyCompound_repr(LazyCompoundObject *self) {
+  return PyUnicode_FromFormat("<nbt2dict.LazyCompound with %zd keys>",
+                              LazyCompound_length(self));
+}
+
+static PyMethodDef LazyCompound_methods[] = {
+    {"keys", (PyCFunction)LazyCompound_keys, METH_NOARGS,
+     "Returns the keys in stored order without decoding any values"},
+    {"values", (PyCFunction)LazyCompound_values, METH_NOARGS,
+     "Decodes and returns all values"},
+    {"items", (PyCFunction)LazyCompound_items, METH_NOARGS,
+     "Decodes and returns all (key, value) pairs"},
+    {"get", (PyCFunction)LazyCompound_get, METH_VARARGS,
+     "Returns the value for key, decoding it on first access, or a default"},
+    {"to_dict", (PyCFunction)LazyCompound_to_dict, METH_NOARGS,
+     "Decodes the whole compound into a regular dictionary"},
+    {NULL, NULL, 0, NULL}};
+
+static PyMappingMethods LazyCompound_as_mapping = {
+    .mp_length = (lenfunc)LazyCompound_length,
+    .mp_subscript = (binaryfunc)LazyCompound_subscript,
+};
+
+static PySequenceMethods LazyCompound_as_sequence = {
+    .sq_contains = (objobjproc)LazyCompound_contains,
+};
+
+static PyTypeObject LazyCompoundType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.LazyCompound",
+    .tp_doc = "Read-only mapping over a TAG_Compound that decodes each value "
+              "on first access and caches it",
+    .tp_basicsize = sizeof(LazyCompoundObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)LazyCompound_dealloc,
+    .tp_repr = (reprfunc)LazyCompound_repr,
+    .tp_richcompare = LazyCompound_richcompare,
+    .tp_iter = (getiterfunc)LazyCompound_iter,
+    .tp_methods = LazyCompound_methods,
+    .tp_as_mapping = &LazyCompound_as_mapping,
+    .tp_as_sequence = &LazyCompound_as_sequence,
+};
+
+enum { STEP_KEY, STEP_INDEX, STEP_EACH };
+
+typedef struct {
+  int kind;
+  NameKey key;
+  Py_ssize_t index;
+} PathStep;
+
+static Py_ssize_t compile_path(PyObject *path, PathStep **out) {
+  Py_ssize_t length;
+  const char *s = PyUnicode_AsUTF8AndSize(path, &length);
+  if (!s)
+    return -1;
+
+  /* the Modified UTF-8 forms of the keys are stored after the steps */
+  PathStep *steps = PyMem_Malloc(sizeof(PathStep) * (size_t)(length + 1) +
+                                 (size_t)length * 2);
+  if (!steps) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  char *encoded = (char *)(steps + length + 1);
+
+  Py_ssize_t count = 0, i = 0;
+  while (length > 0) {
+    Py_ssize_t start = i;
+    while (i < length && s[i] != '.' && s[i] != '[')
+      i++;
+    if (i > start || i == length || s[i] == '.') {
+      NameKey *key = &steps[count].key;
+      steps[count].kind = STEP_KEY;
+      key->utf8 = s + start;
+      key->utf8_length = i - start;
+      key->mutf8_length = encode_mutf8(key->utf8, key->utf8_length, encoded);
+      key->mutf8 = key->utf8;
+      if (key->mutf8_length != key->utf8_length) {
+        key->mutf8 = encoded;
+        encoded += key->mutf8_length;
+      }
+      count++;
+    }
+
+    while (i < length && s[i] == '[') {
+      const char *end = memchr(s + i, ']', (size_t)(length - i));
+      if (!end)
+        goto invalid;
+
+      if (end == s + i + 1) {
+        steps[count].kind = STEP_EACH;
+      } else {
+        char *parsed;
+        long index = strtol(s + i + 1, &parsed, 10);
+        if (parsed != end)
+          goto invalid;
+        steps[count].kind = STEP_INDEX;
+        steps[count].index = index;
+      }
+      count++;
+      i = end - s + 1;
+    }
+
+    if (i == length)
+      break;
+    if (s[i] != '.')
+      goto invalid;
+    i++;
+  }
+
+  *out = steps;
+  return count;
+
+invalid:
+  PyMem_Free(steps);
+  PyErr_Format(PyExc_ValueError, "Invalid path: '%U'", path);
+  return -1;
+}
+
+static PyObject *extract_fail(TapeBuilder *builder) {
+  tape_set_error(builder->tape);
+  return NULL;
+}
+
+static int extract_descend(TapeBuilder *builder, int depth) {
+  if (depth < builder->max_depth)
+    return 0;
+  tape_fail(builder, "Maximum nesting depth of %d exceeded",
+            builder->max_depth);
+  return -1;
+}
+
+/* `depth` is the document depth of the value at `tag_type`; every step
+   moves one level down. */
+static PyObject *extract_from(NBTParser *parser, TapeBuilder *builder,
+                              const PathStep *steps, Py_ssize_t count,
+                              uint8_t tag_type, int depth) {
+  for (Py_ssize_t i = 0; i < count; i++, depth++) {
+    const PathStep *step = &steps[i];
+    if (tag_type == TAG_TBD && tape_read_byte(builder, &tag_type) < 0)
+      return extract_fail(builder);
+
+    if (step->kind == STEP_KEY) {
+      if (tag_type != TAG_COMPOUND)
+        Py_RETURN_NONE;
+
+      while (1) {
+        uint8_t child_tag;
+        uint16_t name_length;
+        if (tape_read_byte(builder, &child_tag) < 0)
+          return extract_fail(builder);
+        if (child_tag == TAG_END)
+          Py_RETURN_NONE;
+
+        if (extract_descend(builder, depth) < 0 ||
+            tape_read_size(builder, &name_length) < 0 ||
+            tape_need(builder, name_length) < 0)
+          return extract_fail(builder);
+        int match = name_key_match(&step->key, builder->data + builder->pos,
+                                   name_length);
+        builder->pos += name_length;
+
+        if (match) {
+          tag_type = child_tag;
+          break;
+        }
+        if (skip_tag_payload(builder, child_tag, depth + 1) < 0)
+          return extract_fail(builder);
+      }
+      continue;
+    }
+
+    uint8_t elem_type = array_elem_type(tag_type);
+    int32_t length;
+    if (tag_type == TAG_LIST) {
+      if (tape_read_byte(builder, &elem_type) < 0)
+        return extract_fail(builder);
+    } else if (elem_type == TAG_END) {
+      Py_RETURN_NONE;
+    }
+    if (tape_read_int(builder, &length) < 0)
+      return extract_fail(builder);
+    if (length < 0) {
+      tape_fail(builder, "Invalid list length: %d", length);
+      return extract_fail(builder);
+    }
+    size_t elem_size = fixed_payload_size(elem_type);
+    if (length > 0 && !elem_size && extract_descend(builder, depth) < 0)
+      return extract_fail(builder);
+
+    if (step->kind == STEP_INDEX) {
+      Py_ssize_t position = step->index;
+      if (position < 0)
+        position += length;
+      if (position < 0 || position >= length)
+        Py_RETURN_NONE;
+
+      if (elem_size) {
+        builder->pos += (size_t)position * elem_size;
+      } else {
+        for (Py_ssize_t j = 0; j < position; j++) {
+          if (skip_tag_payload(builder, elem_type, depth + 1) < 0)
+            return extract_fail(builder);
+        }
+      }
+      tag_type = elem_type;
+      continue;
+    }
+
+    PyObject *list = PyList_New(length);
+    if (!list)
+      return NULL;
+
+    for (int32_t j = 0; j < length; j++) {
+      size_t start = builder->pos;
+      PyObject *item =
+          extract_from(parser, builder, steps + i + 1, count - i - 1,
+                       elem_type, depth + 1);
+      if (!item) {
+        Py_DECREF(list);
+        return NULL;
+      }
+      PyList_SET_ITEM(list, j, item);
+
+      builder->pos = start;
+      if (skip_tag_payload(builder, elem_type, depth + 1) < 0) {
+        Py_DECREF(list);
+        return extract_fail(builder);
+      }
+    }
+    return list;
+  }
+
+  parser->pos = builder->pos;
+  parser->base_depth = depth;
+  return read_tag_payload(parser, tag_type);
+}
+
+static PyObject *extract_path(const Py_buffer *view, PyObject *path,
+                              const ParseOptions *options) {
+  if (!PyUnicode_Check(path)) {
+    PyErr_SetString(PyExc_TypeError, "paths must be strings");
+    return NULL;
+  }
+
+  PathStep *steps;
+  Py_ssize_t count = compile_path(path, &steps);
+  if (count < 0)
+    return NULL;
+
+  NBTParser parser;
+  parser_init(&parser, view->buf, (size_t)view->len);
+  parser_configure(&parser, options, &default_cache);
+  if (options->lazy &&
+      !(parser.lazy_view = PyMemoryView_FromObject(view->obj))) {
+    PyMem_Free(steps);
+    return NULL;
+  }
+
+  Tape errors = {0};
+  TapeBuilder builder;
+  tape_builder_init(&builder, view->buf, (size_t)view->len, &errors, options);
+  uint8_t root_type;
+  PyObject *result = NULL;
+  if (tape_read_root(&builder, &root_type) < 0)
+    extract_fail(&builder);
+  else
+    result = extract_from(&parser, &builder, steps, count, root_type, 0);
+  Py_XDECREF(parser.lazy_view);
+
+  PyMem_Free(steps);
+  return result;
+}
+
+static PyObject *parse_buffer(const Py_buffer *data, ParseCache *cache,
+                              const ParseOptions *options) {
+  NBTParser parser;
+  parser_init(&parser, (const uint8_t *)data->buf, (size_t)data->len);
+  parser_configure(&parser, options, cache);
+
+  if (options->lazy) {
+    parser.lazy_view = PyMemoryView_FromObject(data->obj);
+    if (!parser.lazy_view)
+      return NULL;
+  }
+
+  PyObject *result = parse_root(&parser);
+  Py_XDECREF(parser.lazy_view);
+  return result;
+}
+
+/* Lazy compounds decode from their buffer on access, but inflated and
+   mapped data lives in reused scratch space or a mapping that is released
+   after the call, so a lazy parse of it runs over a bytes copy the proxies
+   keep alive. */
+static PyObject *parse_lazy_copy(const uint8_t *data, size_t length,
+                                 ParseCache *cache,
+                                 const ParseOptions *options) {
+  PyObject *copy = PyBytes_FromStringAndSize((const char *)data,
+                                             (Py_ssize_t)length);
+  if (!copy)
+    return NULL;
+
+  Py_buffer view;
+  PyObject *result = NULL;
+  if (PyObject_GetBuffer(copy, &view, PyBUF_SIMPLE) == 0) {
+    result = parse_buffer(&view, cache, options);
+    PyBuffer_Release(&view);
+  }
+  Py_DECREF(copy);
+  return result;
+}
+
+static Py_ssize_t decode_b64gz(PyObject *obj, ScratchBuffer *b64,
+                               ScratchBuffer *inflated) {
+  Py_buffer data = {0};
+  const uint8_t *src;
+  Py_ssize_t src_len;
+
+  if (PyUnicode_Check(obj)) {
+    src = (const uint8_t *)PyUnicode_AsUTF8AndSize(obj, &src_len);
+    if (!src)
+      return -1;
+  } else {
+    if (PyObject_GetBuffer(obj, &data, PyBUF_SIMPLE) < 0)
+      return -1;
+    src = data.buf;
+    src_len = data.len;
+  }
+
+  Py_ssize_t compressed_len = -1;
+  if (scratch_reserve(b64, (size_t)src_len / 4 * 3 + B64_SLACK) == 0) {
+    compressed_len = b64_decode(src, (size_t)src_len, b64->data);
+    if (compressed_len < 0)
+      PyErr_SetString(PyExc_ValueError, "Invalid base64 data");
+  }
+  PyBuffer_Release(&data);
+  if (compressed_len < 0)
+    return -1;
+
+  return inflate_into(inflated, b64->data, (size_t)compressed_len);
+}
+
+static PyObject *parse_compressed(const uint8_t *data, size_t length,
+                                  ScratchBuffer *shared, ParseCache *cache,
+                                  const ParseOptions *options) {
+  if (options->lazy && !compression_bits(data, length)) {
+    PyErr_SetString(PyExc_ValueError, "Data is neither gzip nor zlib");
+    return NULL;
+  }
+
+  ScratchBuffer local;
+  ScratchBuffer *window = scratch_acquire(shared, &local);
+  PyObject *result = NULL;
+  if (options->lazy) {
+    Py_ssize_t total = inflate_into(window, data, length);
+    if (total >= 0)
+      result = parse_lazy_copy(window->data, (size_t)total, cache, options);
+    scratch_release(window);
+    return result;
+  }
+
+  InflateSource source;
+  if (source_init(&source, data, length, window) == 0) {
+    NBTParser parser;
+    parser_init(&parser, window->data, 0);
+    parser_configure(&parser, options, cache);
+    parser.source = &source;
+
+    result = parse_root(&parser);
+    inflateEnd(&source.stream);
+  }
+  scratch_release(window);
+  return result;
+}
+
+/* Maps the file read-only and decodes straight from the mapping, streaming
+   it through the inflate window when it is gzip or zlib compressed. */
+static PyObject *parse_file(PyObject *path, ScratchBuffer *window,
+                            ParseCache *cache, const ParseOptions *options,
+                            size_t *bytes) {
+  FileMap map;
+  if (file_map(&map, path) < 0)
+    return NULL;
+  *bytes += map.length;
+
+  PyObject *result;
+  if (compression_bits(map.data, map.length)) {
+    result = parse_compressed(map.data, map.length, window, cache, options);
+  } else if (options->lazy) {
+    result = parse_lazy_copy(map.data, map.length, cache, options);
+  } else {
+    NBTParser parser;
+    parser_init(&parser, map.data, map.length);
+    parser_configure(&parser, options, cache);
+    result = parse_root(&parser);
+  }
+  file_unmap(&map);
+  return result;
+}
+
+static PyObject *parse_nbt(PyObject *self, PyObject *const *args,
+                           Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"data", OPTION_NAMES};
+  PyObject *argv[1 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("parse_nbt", args, nargs, kwnames, names,
+                      1 + OPTION_COUNT, 1, 1, argv) < 0 ||
+      parse_options("parse_nbt", argv + 1, 0, &options) < 0)
+    return NULL;
+
+  Py_buffer data;
+  if (PyObject_GetBuffer(argv[0], &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  PyObject *result = parse_buffer(&data, &default_cache, &options);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject *parse_nbt_b64gz(PyObject *self, PyObject *const *args,
+                                 Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"data", OPTION_NAMES};
+  PyObject *argv[1 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("parse_nbt_b64gz", args, nargs, kwnames, names,
+                      1 + OPTION_COUNT, 1, 1, argv) < 0 ||
+      parse_options("parse_nbt_b64gz", argv + 1, 0, &options) < 0)
+    return NULL;
+
+  ScratchBuffer local;
+  ScratchBuffer *inflated = scratch_acquire(&inflate_scratch, &local);
+  Py_ssize_t length = decode_b64gz(argv[0], &b64_scratch, inflated);
+  PyObject *result = NULL;
+  if (length >= 0 && options.lazy) {
+    result = parse_lazy_copy(inflated->data, (size_t)length, &default_cache,
+                             &options);
+  } else if (length >= 0) {
+    NBTParser parser;
+    parser_init(&parser, inflated->data, (size_t)length);
+    parser_configure(&parser, &options, &default_cache);
+    result = parse_root(&parser);
+  }
+  scratch_release(inflated);
+  return result;
+}
+
+static PyObject *parse_nbt_compressed(PyObject *self, PyObject *const *args,
+                                      Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"data", OPTION_NAMES};
+  PyObject *argv[1 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("parse_nbt_compressed", args, nargs, kwnames, names,
+                      1 + OPTION_COUNT, 1, 1, argv) < 0 ||
+      parse_options("parse_nbt_compressed", argv + 1, 0, &options) < 0)
+    return NULL;
+
+  Py_buffer data;
+  if (PyObject_GetBuffer(argv[0], &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  PyObject *result =
+      parse_compressed(data.buf, (size_t)data.len, &inflate_scratch,
+                       &default_cache, &options);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject *parse_nbt_file(PyObject *self, PyObject *const *args,
+                                Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"path", OPTION_NAMES};
+  PyObject *argv[1 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("parse_nbt_file", args, nargs, kwnames, names,
+                      1 + OPTION_COUNT, 1, 1, argv) < 0 ||
+      parse_options("parse_nbt_file", argv + 1, 0, &options) < 0)
+    return NULL;
+
+  size_t bytes = 0;
+  return parse_file(argv[0], &inflate_scratch, &default_cache, &options,
+                    &bytes);
+}
+
+static PyObject *parse_many(PyObject *self, PyObject *const *args,
+                            Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"buffers", "threads", OPTION_NAMES};
+  PyObject *argv[2 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("parse_many", args, nargs, kwnames, names,
+                      2 + OPTION_COUNT, 1, 2, argv) < 0 ||
+      parse_options("parse_many", argv + 2, 0, &options) < 0)
+    return NULL;
+
+  long threads = 0;
+  if (argv[1]) {
+    threads = PyLong_AsLong(argv[1]);
+    if (threads == -1 && PyErr_Occurred())
+      return NULL;
+  }
+
+  PyObject *seq = PySequence_Fast(argv[0], "buffers must be a sequence");
+  if (!seq)
+    return NULL;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  ParseJob *jobs = PyMem_Calloc(count ? (size_t)count : 1, sizeof(ParseJob));
+  if (!jobs) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  PyObject *result = NULL;
+  Py_ssize_t acquired = 0;
+  for (; acquired < count; acquired++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq, acquired);
+    if (PyObject_GetBuffer(item, &jobs[acquired].view, PyBUF_SIMPLE) < 0)
+      goto done;
+  }
+
+  if (threads <= 0)
+    threads = cpu_count();
+  if (threads > count)
+    threads = (long)count;
+
+  result = PyList_New(count);
+  if (!result)
+    goto done;
+
+  /* On one thread the tape pass could not overlap with anything, so the
+     buffers are decoded directly, as is varint NBT, which tapes cannot
+     index. */
+  if (threads <= 1 || options.varint) {
+    for (Py_ssize_t i = 0; i < count; i++) {
+      PyObject *item = parse_buffer(&jobs[i].view, &default_cache, &options);
+      if (!item) {
+        Py_CLEAR(result);
+        goto done;
+      }
+      PyList_SET_ITEM(result, i, item);
+    }
+    goto done;
+  }
+
+  /* Buffers are materialized in the order their tapes finish. An invalid
+     buffer is only reported once all are indexed, so the error is the one
+     for the first invalid buffer, as with a sequential loop. */
+  JobQueue queue = {jobs, (size_t)count, &options, 0};
+  size_t invalid = (size_t)count;
+  if (queue_start(&queue, (int)threads) < 0) {
+    Py_CLEAR(result);
+  } else {
+    for (Py_ssize_t taken = 0; taken < count; taken++) {
+      size_t i = queue_take(&queue);
+      ParseJob *job = &jobs[i];
+      if (job->tape.status != TAPE_OK) {
+        invalid = i < invalid ? i : invalid;
+        continue;
+      }
+      if (invalid < (size_t)count)
+        continue;
+
+      NBTParser parser;
+      parser_init(&parser, job->view.buf, (size_t)job->view.len);
+      parser_configure(&parser, &options, &default_cache);
+      PyObject *item = NULL;
+      if (!options.lazy ||
+          (parser.lazy_view = PyMemoryView_FromObject(job->view.obj)))
+        item = materialize_tape(&job->tape, 0, &parser);
+      Py_XDECREF(parser.lazy_view);
+      if (!item) {
+        Py_CLEAR(result);
+        break;
+      }
+      PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+      tape_free(&job->tape);
+    }
+  }
+  queue_stop(&queue);
+  if (result && invalid < (size_t)count) {
+    tape_set_error(&jobs[invalid].tape);
+    Py_CLEAR(result);
+  }
+
+done:
+  for (Py_ssize_t i = 0; i < acquired; i++) {
+    PyBuffer_Release(&jobs[i].view);
+    tape_free(&jobs[i].tape);
+  }
+  PyMem_Free(jobs);
+  Py_DECREF(seq);
+  return result;
+}
+
+static PyObject *extract(PyObject *self, PyObject *const *args,
+                         Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"data", "paths", OPTION_NAMES};
+  PyObject *argv[2 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("extract", args, nargs, kwnames, names,
+                      2 + OPTION_COUNT, 2, 2, argv) < 0 ||
+      parse_options("extract", argv + 2, NO_VARINT, &options) < 0)
+    return NULL;
+
+  Py_buffer data;
+  PyObject *paths = argv[1];
+  if (PyObject_GetBuffer(argv[0], &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  PyObject *result = NULL;
+  if (PyUnicode_Check(paths)) {
+    result = extract_path(&data, paths, &options);
+    PyBuffer_Release(&data);
+    return result;
+  }
+
+  PyObject *seq = PySequence_Fast(paths, "paths must be a sequence of strings");
+  if (!seq) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  result = PyList_New(count);
+  for (Py_ssize_t i = 0; result && i < count; i++) {
+    PyObject *value =
+        extract_path(&data, PySequence_Fast_GET_ITEM(seq, i), &options);
+    if (!value) {
+      Py_CLEAR(result);
+      break;
+    }
+    PyList_SET_ITEM(result, i, value);
+  }
+
+  Py_DECREF(seq);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject *validate(PyObject *self, PyObject *const *args,
+                          Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"data", OPTION_NAMES};
+  PyObject *argv[1 + OPTION_COUNT];
+  ParseOptions options;
+  if (parse_fast_args("validate", args, nargs, kwnames, names,
+                      1 + OPTION_COUNT, 1, 1, argv) < 0 ||
+      parse_options("validate", argv + 1, NO_VARINT, &options) < 0)
+    return NULL;
+
+  Py_buffer data;
+  if (PyObject_GetBuffer(argv[0], &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  Tape errors = {0};
+  TapeBuilder builder;
+  tape_builder_init(&builder, data.buf, (size_t)data.len, &errors, &options);
+  int status;
+  Py_BEGIN_ALLOW_THREADS
+  status = skip_root(&builder);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&data);
+
+  if (status < 0) {
+    tape_set_error(&errors);
+    return NULL;
+  }
+  return PyLong_FromSize_t(builder.pos);
+}
+
+typedef struct {
+  PyObject_HEAD
+  ParseOptions options;
+  ParseCache *cache;
+  ScratchBuffer b64_scratch;
+  ScratchBuffer inflate_scratch;
+  size_t calls;
+  size_t bytes;
+} ParserObject;
+
+static PyObject *Parser_new(PyTypeObject *type, PyObject *args,
+                            PyObject *kwargs) {
+  static char *kwlist[] = {OPTION_NAMES, NULL};
+  PyObject *values[OPTION_COUNT] = {NULL};
+  ParseOptions options;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|" OPTION_FORMAT, kwlist,
+                                   OPTION_TARGETS(values)) ||
+      parse_options("Parser", values, 0, &options) < 0)
+    return NULL;
+
+  ParserObject *self = (ParserObject *)type->tp_alloc(type, 0);
+  if (!self)
+    return NULL;
+
+  self->cache = PyMem_Calloc(1, sizeof(ParseCache));
+  if (!self->cache) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  self->options = options;
+  return (PyObject *)self;
+}
+
+static void Parser_dealloc(ParserObject *self) {
+  if (self->cache) {
+    cache_clear(self->cache);
+    PyMem_Free(self->cache);
+  }
+  PyMem_RawFree(self->b64_scratch.data);
+  PyMem_RawFree(self->inflate_scratch.data);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Parser_parse(ParserObject *self, PyObject *arg) {
+  Py_buffer data;
+  if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  self->calls++;
+  self->bytes += (size_t)data.len;
+  PyObject *result = parse_buffer(&data, self->cache, &self->options);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject *Parser_parse_b64gz(ParserObject *self, PyObject *arg) {
+  ScratchBuffer local;
+  ScratchBuffer *inflated = scratch_acquire(&self->inflate_scratch, &local);
+  Py_ssize_t length = decode_b64gz(arg, &self->b64_scratch, inflated);
+  if (length < 0) {
+    scratch_release(inflated);
+    return NULL;
+  }
+
+  self->calls++;
+  self->bytes += (size_t)length;
+  PyObject *result;
+  if (self->options.lazy) {
+    result = parse_lazy_copy(inflated->data, (size_t)length, self->cache,
+                             &self->options);
+  } else {
+    NBTParser parser;
+    parser_init(&parser, inflated->data, (size_t)length);
+    parser_configure(&parser, &self->options, self->cache);
+    result = parse_root(&parser);
+  }
+  scratch_release(inflated);
+  return result;
+}
+
+static PyObject *Parser_parse_compressed(ParserObject *self, PyObject *arg) {
+  Py_buffer data;
+  if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  self->calls++;
+  self->bytes += (size_t)data.len;
+  PyObject *result =
+      parse_compressed(data.buf, (size_t)data.len, &self->inflate_scratch,
+                       self->cache, &self->options);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject *Parser_parse_file(ParserObject *self, PyObject *path) {
+  self->calls++;
+  return parse_file(path, &self->inflate_scratch, self->cache,
+                    &self->options, &self->bytes);
+}
+
+static PyObject *Parser_clear(ParserObject *self,
+                              PyObject *Py_UNUSED(ignored)) {
+  cache_clear(self->cache);
+  self->calls = self->bytes = 0;
+  Py_RETURN_NONE;
+}
+
+static PyObject *Parser_stats(ParserObject *self, void *Py_UNUSED(closure)) {
+  return Py_BuildValue(
+      "{snsnsnsnsnsn}", "calls", (Py_ssize_t)self->calls, "bytes",
+      (Py_ssize_t)self->bytes, "key_hits", (Py_ssize_t)self->cache->key_hits,
+      "key_misses", (Py_ssize_t)self->cache->key_misses, "shape_hits",
+      (Py_ssize_t)self->cache->shape_hits, "shape_misses",
+      (Py_ssize_t)self->cache->shape_misses);
+}
+
+static PyMethodDef Parser_methods[] = {
+    {"parse", (PyCFunction)Parser_parse, METH_O,
+     "Parses NBT binary data and returns a dictionary"},
+    {"parse_b64gz", (PyCFunction)Parser_parse_b64gz, METH_O,
+     "Decodes base64, inflates gzip and parses the NBT data in one call"},
+    {"parse_compressed", (PyCFunction)Parser_parse_compressed, METH_O,
+     "Parses gzip or zlib compressed NBT data while inflating it"},
+    {"parse_file", (PyCFunction)Parser_parse_file, METH_O,
+     "Parses an NBT file, compressed or not, from a read-only mapping"},
+    {"clear", (PyCFunction)Parser_clear, METH_NOARGS,
+     "Drops the cached keys and shapes and resets the statistics"},
+    {NULL, NULL, 0, NULL}};
+
+static PyGetSetDef Parser_getset[] = {
+    {"stats", (getter)Parser_stats, NULL,
+     "Calls, bytes parsed and key/shape cache hits and misses", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject ParserType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.Parser",
+    .tp_doc = "Parser(*, arrays='list', lazy=False, max_depth=512, "
+              "endian='big', varint=False, nameless_root=False) keeps its "
+              "options, key and shape caches and decompression buffers "
+              "across calls",
+    .tp_basicsize = sizeof(ParserObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Parser_new,
+    .tp_dealloc = (destructor)Parser_dealloc,
+    .tp_methods = Parser_methods,
+    .tp_getset = Parser_getset,
+};
+
+typedef struct {
+  PyObject_HEAD
+  ParseOptions options;
+  ParseCache *cache;
+  ScratchBuffer buffer;
+  size_t length;
+  DecodeResume resume;
+} IncrementalParserObject;
+
+static PyObject *IncrementalParser_new(PyTypeObject *type, PyObject *args,
+                                       PyObject *kwargs) {
+  static char *kwlist[] = {OPTION_NAMES, NULL};
+  PyObject *values[OPTION_COUNT] = {NULL};
+  ParseOptions options;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|" OPTION_FORMAT, kwlist,
+                                   OPTION_TARGETS(values)) ||
+      parse_options("IncrementalParser", values, NO_LAZY, &options) < 0)
+    return NULL;
+
+  IncrementalParserObject *self =
+      (IncrementalParserObject *)type->tp_alloc(type, 0);
+  if (!self)
+    return NULL;
+
+  self->cache = PyMem_Calloc(1, sizeof(ParseCache));
+  if (!self->cache) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  self->options = options;
+  return (PyObject *)self;
+}
+
+static void incremental_reset(IncrementalParserObject *self) {
+  if (self->resume.active) {
+    stack_free(&self->resume.stack);
+    self->resume.active = 0;
+  }
+  self->length = 0;
+}
+
+static void IncrementalParser_dealloc(IncrementalParserObject *self) {
+  incremental_reset(self);
+  if (self->cache) {
+    cache_clear(self->cache);
+    PyMem_Free(self->cache);
+  }
+  PyMem_RawFree(self->buffer.data);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Appends a fragment and decodes as far as it reaches. Only the bytes of
+   the value that ran out of input are kept; everything before it already
+   lives in the parked frames. */
+static PyObject *IncrementalParser_feed(IncrementalParserObject *self,
+                                        PyObject *arg) {
+  Py_buffer data;
+  if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  int status = scratch_reserve(&self->buffer, self->length + (size_t)data.len);
+  if (status == 0) {
+    memcpy(self->buffer.data + self->length, data.buf, (size_t)data.len);
+    self->length += (size_t)data.len;
+  }
+  PyBuffer_Release(&data);
+  if (status < 0)
+    return NULL;
+
+  PyObject *roots = PyList_New(0);
+  if (!roots)
+    return NULL;
+
+  size_t pos = 0;
+  while (pos < self->length) {
+    NBTParser parser;
+    parser_init(&parser, self->buffer.data + pos, self->length - pos);
+    parser_configure(&parser, &self->options, self->cache);
+    parser.resume = &self->resume;
+
+    PyObject *root = self->resume.active ? read_tag_payload(&parser, TAG_END)
+                                         : parse_root(&parser);
+    if (!root && parser.starved) {
+      PyErr_Clear();
+      if (self->resume.active)
+        pos += parser.pos;
+      break;
+    }
+    if (!root || PyList_Append(roots, root) < 0) {
+      Py_XDECREF(root);
+      Py_DECREF(roots);
+      incremental_reset(self);
+      return NULL;
+    }
+    Py_DECREF(root);
+    pos += parser.pos;
+  }
+
+  self->length -= pos;
+  if (pos && self->length)
+    memmove(self->buffer.data, self->buffer.data + pos, self->length);
+  return roots;
+}
+
+static PyObject *IncrementalParser_pending(IncrementalParserObject *self,
+                                           void *Py_UNUSED(closure)) {
+  return PyBool_FromLong(self->length > 0 || self->resume.active);
+}
+
+static PyMethodDef IncrementalParser_methods[] = {
+    {"feed", (PyCFunction)IncrementalParser_feed, METH_O,
+     "Adds a fragment of the stream and returns the roots it completes"},
+    {NULL, NULL, 0, NULL}};
+
+static PyGetSetDef IncrementalParser_getset[] = {
+    {"pending", (getter)IncrementalParser_pending, NULL,
+     "Whether a root has been started but not completed", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject IncrementalParserType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.IncrementalParser",
+    .tp_doc = "IncrementalParser(*, arrays='list', max_depth=512, "
+              "endian='big', varint=False, nameless_root=False) decodes a "
+              "stream of NBT roots from fragments passed to feed(); lazy is "
+              "not supported",
+    .tp_basicsize = sizeof(IncrementalParserObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = IncrementalParser_new,
+    .tp_dealloc = (destructor)IncrementalParser_dealloc,
+    .tp_methods = IncrementalParser_methods,
+    .tp_getset = IncrementalParser_getset,
+};
+
+#define REGION_SECTOR 4096
+#define REGION_CHUNKS 1024
+
+enum { CHUNK_GZIP = 1, CHUNK_ZLIB = 2, CHUNK_NONE = 3, CHUNK_LZ4 = 4 };
+enum { REGION_OK, REGION_ABSENT, REGION_BAD_OFFSET, REGION_BAD_LENGTH };
+
+static inline uint32_t load_be32(const uint8_t *src) {
+  return (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 |
+         (uint32_t)src[2] << 8 | src[3];
+}
+
+static inline int region_index(int x, int z) {
+  return (x & 31) + (z & 31) * 32;
+}
+
+/* Resolves a chunk through the location table: 3 bytes of sector offset
+   and 1 of sector count, then a 4-byte length (counting the compression
+   byte) at the start of the chunk's sectors. Runs without the GIL. */
+static int region_locate(const uint8_t *region, size_t size, int index,
+                         const uint8_t **data, size_t *length,
+                         uint8_t *compression) {
+  if (size < 2 * REGION_SECTOR)
+    return REGION_ABSENT;
+
+  const uint8_t *entry = region + index * 4;
+  size_t offset = (size_t)(load_be32(entry) >> 8) * REGION_SECTOR;
+  if (offset == 0 && entry[3] == 0)
+    return REGION_ABSENT;
+  if (offset < 2 * REGION_SECTOR || offset > size - 5)
+    return REGION_BAD_OFFSET;
+
+  size_t chunk_length = load_be32(region + offset);
+  if (chunk_length == 0 || chunk_length - 1 > size - offset - 5)
+    return REGION_BAD_LENGTH;
+
+  *compression = region[offset + 4];
+  *data = region + offset + 5;
+  *length = chunk_length - 1;
+  return REGION_OK;
+}
+
+static void region_set_error(int status, int index) {
+  PyErr_Format(PyExc_ValueError,
+               status == REGION_BAD_OFFSET
+                   ? "Chunk (%d, %d) points outside the region file"
+                   : "Chunk (%d, %d) has an invalid length",
+               index & 31, index >> 5);
+}
+
+/* Decodes one chunk payload with the parser options; gzip and zlib chunks
+   are streamed through the inflate window. */
+static PyObject *region_parse_chunk(const uint8_t *data, size_t length,
+                                    uint8_t compression, int index,
+                                    ScratchBuffer *window, ParseCache *cache,
+                                    const ParseOptions *options) {
+  switch (compression) {
+  case CHUNK_GZIP:
+  case CHUNK_ZLIB:
+    return parse_compressed(data, length, window, cache, options);
+  case CHUNK_NONE: {
+    if (options->lazy)
+      return parse_lazy_copy(data, length, cache, options);
+    NBTParser parser;
+    parser_init(&parser, data, length);
+    parser_configure(&parser, options, cache);
+    return parse_root(&parser);
+  }
+  case CHUNK_LZ4:
+    PyErr_Format(PyExc_ValueError,
+                 "Chunk (%d, %d) uses LZ4 compression, which is not supported",
+                 index & 31, index >> 5);
+    return NULL;
+  default:
+    PyErr_Format(PyExc_ValueError,
+                 (compression & 0x80)
+                     ? "Chunk (%d, %d) is stored in an external .mcc file"
+                     : "Chunk (%d, %d) has unknown compression type %d",
+                 index & 31, index >> 5, compression);
+    return NULL;
+  }
+}
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *path;
+  FileMap map;
+  int open;
+  ParseOptions options;
+  ParseCache *cache;
+  ScratchBuffer window;
+} RegionFileObject;
+
+static PyObject *RegionFile_new(PyTypeObject *type, PyObject *args,
+                                PyObject *kwargs) {
+  static char *kwlist[] = {"path", OPTION_NAMES, NULL};
+  PyObject *path, *values[OPTION_COUNT] = {NULL};
+  ParseOptions options;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|" OPTION_FORMAT, kwlist,
+                                   &path, OPTION_TARGETS(values)) ||
+      parse_options("RegionFile", values, 0, &options) < 0)
+    return NULL;
+
+  RegionFileObject *self = (RegionFileObject *)type->tp_alloc(type, 0);
+  if (!self)
+    return NULL;
+
+  self->options = options;
+  self->cache = PyMem_Calloc(1, sizeof(ParseCache));
+  if (!self->cache) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  if (file_map(&self->map, path) < 0) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  self->open = 1;
+  Py_INCREF(path);
+  self->path = path;
+
+  if (self->map.length && self->map.length < 2 * REGION_SECTOR) {
+    PyErr_SetString(PyExc_ValueError, "Region file header is truncated");
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+static void region_close(RegionFileObject *self) {
+  if (self->open) {
+    file_unmap(&self->map);
+    self->open = 0;
+  }
+}
+
+static void RegionFile_dealloc(RegionFileObject *self) {
+  region_close(self);
+  if (self->cache) {
+    cache_clear(self->cache);
+    PyMem_Free(self->cache);
+  }
+  PyMem_RawFree(self->window.data);
+  Py_XDECREF(self->path);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int region_check_open(RegionFileObject *self) {
+  if (self->open)
+    return 0;
+  PyErr_SetString(PyExc_ValueError, "I/O operation on closed region file");
+  return -1;
+}
+
+static PyObject *RegionFile_chunk(RegionFileObject *self, PyObject *args) {
+  int x, z;
+  if (!PyArg_ParseTuple(args, "ii", &x, &z) || region_check_open(self) < 0)
+    return NULL;
+
+  int index = region_index(x, z);
+  const uint8_t *data;
+  size_t length;
+  uint8_t compression;
+  int status = region_locate(self->map.data, self->map.length, index, &data,
+                             &length, &compression);
+  if (status == REGION_ABSENT)
+    Py_RETURN_NONE;
+  if (status != REGION_OK) {
+    region_set_error(status, index);
+    return NULL;
+  }
+  return region_parse_chunk(data, length, compression, index, &self->window,
+                            self->cache, &self->options);
+}
+
+static PyObject *RegionFile_timestamp(RegionFileObject *self,
+                                      PyObject *args) {
+  int x, z;
+  if (!PyArg_ParseTuple(args, "ii", &x, &z) || region_check_open(self) < 0)
+    return NULL;
+  if (self->map.length < 2 * REGION_SECTOR)
+    return PyLong_FromLong(0);
+
+  const uint8_t *entry =
+      self->map.data + REGION_SECTOR + region_index(x, z) * 4;
+  return PyLong_FromUnsignedLong(load_be32(entry));
+}
+
+static PyObject *RegionFile_chunks(RegionFileObject *self,
+                                   PyObject *Py_UNUSED(ignored)) {
+  if (region_check_open(self) < 0)
+    return NULL;
+
+  PyObject *coords = PyList_New(0);
+  for (int index = 0; coords && index < REGION_CHUNKS; index++) {
+    const uint8_t *data;
+    size_t length;
+    uint8_t compression;
+    if (region_locate(self->map.data, self->map.length, index, &data, &length,
+                      &compression) == REGION_ABSENT)
+      continue;
+
+    PyObject *coord = Py_BuildValue("(ii)", index & 31, index >> 5);
+    if (!coord || PyList_Append(coords, coord) < 0)
+      Py_CLEAR(coords);
+    Py_XDECREF(coord);
+  }
+  return coords;
+}
+
+static PyObject *RegionFile_close(RegionFileObject *self,
+                                  PyObject *Py_UNUSED(ignored)) {
+  region_close(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *RegionFile_enter(RegionFileObject *self,
+                                  PyObject *Py_UNUSED(ignored)) {
+  if (region_check_open(self) < 0)
+    return NULL;
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *RegionFile_exit(RegionFileObject *self, PyObject *args) {
+  region_close(self);
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef RegionFile_methods[] = {
+    {"chunk", (PyCFunction)RegionFile_chunk, METH_VARARGS,
+     "Decompresses and parses chunk (x, z), or returns None if it is absent"},
+    {"timestamp", (PyCFunction)RegionFile_timestamp, METH_VARARGS,
+     "Returns the last modification time of chunk (x, z) in epoch seconds"},
+    {"chunks", (PyCFunction)RegionFile_chunks, METH_NOARGS,
+     "Returns the (x, z) coordinates of the chunks present in the file"},
+    {"close", (PyCFunction)RegionFile_close, METH_NOARGS,
+     "Releases the file mapping"},
+    {"__enter__", (PyCFunction)RegionFile_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)RegionFile_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef RegionFile_members[] = {
+    {"path", T_OBJECT, offsetof(RegionFileObject, path), READONLY,
+     "The path the region file was opened from"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyTypeObject RegionFileType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.RegionFile",
+    .tp_doc = "RegionFile(path, *, arrays='list', lazy=False, "
+              "max_depth=512, endian='big', varint=False, "
+              "nameless_root=False) maps an Anvil .mca file and parses its "
+              "chunks on demand. Chunk coordinates are taken modulo 32",
+    .tp_basicsize = sizeof(RegionFileObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = RegionFile_new,
+    .tp_dealloc = (destructor)RegionFile_dealloc,
+    .tp_methods = RegionFile_methods,
+    .tp_members = RegionFile_members,
+};
+
+typedef struct {
+  const uint8_t *data;
+  size_t length;
+  ScratchBuffer inflated;
+  const uint8_t *nbt;
+  size_t nbt_length;
+  Tape tape;
+  uint32_t region;
+  uint16_t index;
+  uint8_t compression;
+} ChunkJob;
+
+/* Chunks of one or more mapped region files, decoded to tapes by a pool of
+   native threads and handed back in completion order. Workers stall once
+   `limit` finished chunks are waiting, which bounds memory on big worlds. */
+typedef struct {
+  PyObject_HEAD
+  PyObject *paths;
+  FileMap *maps;
+  size_t map_count;
+  ChunkJob *jobs;
+  size_t count;
+  volatile size_t next;
+  size_t *done;
+  size_t finished;
+  size_t consumed;
+  size_t limit;
+  int cancelled;
+  nbt_mutex_t lock;
+  nbt_cond_t ready;
+  nbt_cond_t space;
+  int synced;
+  nbt_thread_t *threads;
+  int thread_count;
+  ParseOptions options;
+  int with_path;
+} ChunkIteratorObject;
+
+static void chunk_fail(ChunkJob *job, const char *format, int value) {
+  job->tape.status = TAPE_INVALID;
+  snprintf(job->tape.error, sizeof(job->tape.error), format, value);
+}
+
+static void chunk_decode(ChunkJob *job, const ParseOptions *options) {
+  if (job->tape.status != TAPE_OK)
+    return;
+
+  switch (job->compression) {
+  case CHUNK_GZIP:
+  case CHUNK_ZLIB: {
+    Py_ssize_t total =
+        inflate_raw(&job->inflated, job->data, job->length, job->tape.error,
+                    sizeof(job->tape.error));
+    if (total < 0) {
+      job->tape.status = job->tape.error[0] ? TAPE_INVALID : TAPE_NO_MEMORY;
+      return;
+    }
+    job->nbt = job->inflated.data;
+    job->nbt_length = (size_t)total;
+    break;
+  }
+  case CHUNK_NONE:
+    job->nbt = job->data;
+    job->nbt_length = job->length;
+    break;
+  case CHUNK_LZ4:
+    chunk_fail(job, "LZ4 compression is not supported", 0);
+    return;
+  default:
+    chunk_fail(job,
+               (job->compression & 0x80) ? "Stored in an external .mcc file"
+                                         : "Unknown compression type %d",
+               job->compression);
+    return;
+  }
+  tape_build(&job->tape, job->nbt, job->nbt_length, options);
+}
+
+static void chunk_job_free(ChunkJob *job) {
+  tape_free(&job->tape);
+  PyMem_RawFree(job->inflated.data);
+  job->inflated.data = NULL;
+  job->inflated.capacity = 0;
+}
+
+static NBT_THREAD_FUNC chunk_worker(void *arg) {
+  ChunkIteratorObject *pool = arg;
+  for (;;) {
+    mutex_lock(&pool->lock);
+    while (!pool->cancelled && pool->finished - pool->consumed >= pool->limit)
+      cond_wait(&pool->space, &pool->lock);
+    int cancelled = pool->cancelled;
+    mutex_unlock(&pool->lock);
+
+    size_t i;
+    if (cancelled || (i = atomic_next(&pool->next)) >= pool->count)
+      break;
+    chunk_decode(&pool->jobs[i], &pool->options);
+
+    mutex_lock(&pool->lock);
+    pool->done[pool->finished++] = i;
+    cond_signal(&pool->ready);
+    mutex_unlock(&pool->lock);
+  }
+  return NBT_THREAD_RETURN;
+}
+
+/* Stops the workers (finishing the chunks they hold) and joins them. */
+static void chunk_pool_stop(ChunkIteratorObject *pool) {
+  int count = pool->thread_count;
+  if (!count)
+    return;
+  pool->thread_count = 0;
+
+  Py_BEGIN_ALLOW_THREADS
+  mutex_lock(&pool->lock);
+  pool->cancelled = 1;
+  cond_broadcast(&pool->space);
+  mutex_unlock(&pool->lock);
+  for (int i = 0; i < count; i++)
+    thread_join(pool->threads[i]);
+  Py_END_ALLOW_THREADS
+}
+
+static void ChunkIterator_dealloc(ChunkIteratorObject *self) {
+  chunk_pool_stop(self);
+  for (size_t i = 0; i < self->count; i++)
+    chunk_job_free(&self->jobs[i]);
+  for (size_t i = 0; i < self->map_count; i++)
+    file_unmap(&self->maps[i]);
+  if (self->synced)
+    sync_destroy(&self->lock, &self->ready, &self->space);
+  PyMem_RawFree(self->threads);
+  PyMem_Free(self->done);
+  PyMem_Free(self->jobs);
+  PyMem_Free(self->maps);
+  Py_XDECREF(self->paths);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyTypeObject ChunkIteratorType;
+
+static void chunk_pool_add(ChunkIteratorObject *pool, uint32_t region,
+                           int index) {
+  const FileMap *map = &pool->maps[region];
+  ChunkJob *job = &pool->jobs[pool->count];
+  int status = region_locate(map->data, map->length, index, &job->data,
+                             &job->length, &job->compression);
+  if (status == REGION_ABSENT)
+    return;
+  job->region = region;
+  job->index = (uint16_t)index;
+  if (status == REGION_BAD_OFFSET)
+    chunk_fail(job, "Location points outside the region file", 0);
+  else if (status == REGION_BAD_LENGTH)
+    chunk_fail(job, "Invalid chunk length", 0);
+  pool->count++;
+}
+
+/* Maps every region file in paths, queues their chunks and starts the
+   workers. */
+static ChunkIteratorObject *chunk_pool_new(PyObject *paths, long threads,
+                                           const ParseOptions *options,
+                                           int with_path) {
+  ChunkIteratorObject *pool =
+      PyObject_New(ChunkIteratorObject, &ChunkIteratorType);
+  if (!pool) {
+    Py_DECREF(paths);
+    return NULL;
+  }
+  memset((char *)pool + sizeof(PyObject), 0,
+         sizeof(ChunkIteratorObject) - sizeof(PyObject));
+  pool->paths = paths;
+  pool->options = *options;
+  pool->with_path = with_path;
+  sync_init(&pool->lock, &pool->ready, &pool->space);
+  pool->synced = 1;
+
+  Py_ssize_t regions = PyList_GET_SIZE(paths);
+  pool->maps = PyMem_Calloc(regions ? (size_t)regions : 1, sizeof(FileMap));
+  if (!pool->maps)
+    goto nomemory;
+
+  size_t present = 0;
+  for (Py_ssize_t r = 0; r < regions; r++) {
+    PyObject *path = PyList_GET_ITEM(paths, r);
+    FileMap *map = &pool->maps[r];
+    if (file_map(map, path) < 0)
+      goto error;
+    pool->map_count++;
+    if (map->length && map->length < 2 * REGION_SECTOR) {
+      PyErr_Format(PyExc_ValueError, "Region file header is truncated: %R",
+                   path);
+      goto error;
+    }
+    for (int index = 0; map->length && index < REGION_CHUNKS; index++)
+      present += load_be32(map->data + index * 4) != 0;
+  }
+
+  pool->jobs = PyMem_Calloc(present ? present : 1, sizeof(ChunkJob));
+  pool->done = PyMem_Calloc(present ? present : 1, sizeof(size_t));
+  if (!pool->jobs || !pool->done)
+    goto nomemory;
+  for (Py_ssize_t r = 0; r < regions; r++) {
+    for (int index = 0; index < REGION_CHUNKS; index++)
+      chunk_pool_add(pool, (uint32_t)r, index);
+  }
+
+  if (threads <= 0)
+    threads = cpu_count();
+  if ((size_t)threads > pool->count)
+    threads = (long)pool->count;
+  pool->limit = (size_t)threads * 4;
+  if (threads) {
+    pool->threads = PyMem_RawMalloc((size_t)threads * sizeof(nbt_thread_t));
+    if (!pool->threads)
+      goto nomemory;
+  }
+  for (; pool->thread_count < threads; pool->thread_count++) {
+    if (thread_start(&pool->threads[pool->thread_count], chunk_worker,
+                     pool) < 0)
+      break;
+  }
+  if (threads && !pool->thread_count) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not start worker threads");
+    goto error;
+  }
+  return pool;
+
+nomemory:
+  PyErr_NoMemory();
+error:
+  Py_DECREF(pool);
+  return NULL;
+}
+
+/* Waits for the next finished chunk, or returns NULL once all are taken. */
+static ChunkJob *chunk_pool_take(ChunkIteratorObject *pool) {
+  ChunkJob *job = NULL;
+  Py_BEGIN_ALLOW_THREADS
+  mutex_lock(&pool->lock);
+  while (pool->finished == pool->consumed && pool->consumed < pool->count)
+    cond_wait(&pool->ready, &pool->lock);
+  if (pool->consumed < pool->count) {
+    job = &pool->jobs[pool->done[pool->consumed++]];
+    cond_signal(&pool->space);
+  }
+  mutex_unlock(&pool->lock);
+  Py_END_ALLOW_THREADS
+  return job;
+}
+
+/* Builds (x, z, chunk), or (path, x, z, chunk) for a world, and releases
+   the chunk's buffers. */
+static PyObject *chunk_pool_item(ChunkIteratorObject *pool, ChunkJob *job) {
+  int x = job->index & 31, z = job->index >> 5;
+  PyObject *path = PyList_GET_ITEM(pool->paths, job->region);
+  PyObject *chunk = NULL;
+
+  if (job->tape.status == TAPE_NO_MEMORY) {
+    PyErr_NoMemory();
+  } else if (job->tape.status != TAPE_OK) {
+    if (pool->with_path)
+      PyErr_Format(PyExc_ValueError, "Chunk (%d, %d) of %R: %s", x, z, path,
+                   job->tape.error);
+    else
+      PyErr_Format(PyExc_ValueError, "Chunk (%d, %d): %s", x, z,
+                   job->tape.error);
+  } else if (pool->options.lazy) {
+    /* the chunk's buffers are released below, the proxies need a copy */
+    chunk = parse_lazy_copy(job->nbt, job->nbt_length, &default_cache,
+                            &pool->options);
+  } else {
+    NBTParser parser;
+    parser_init(&parser, job->nbt, job->nbt_length);
+    parser_configure(&parser, &pool->options, &default_cache);
+    chunk = materialize_tape(&job->tape, 0, &parser);
+  }
+  chunk_job_free(job);
+
+  if (!chunk)
+    return NULL;
+  if (pool->with_path)
+    return Py_BuildValue("(OiiN)", path, x, z, chunk);
+  return Py_BuildValue("(iiN)", x, z, chunk);
+}
+
+static PyObject *ChunkIterator_next(ChunkIteratorObject *self) {
+  ChunkJob *job = chunk_pool_take(self);
+  if (!job) {
+    chunk_pool_stop(self);
+    return NULL;
+  }
+  return chunk_pool_item(self, job);
+}
+
+static PyTypeObject ChunkIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "nbt2dict.ChunkIterator",
+    .tp_basicsize = sizeof(ChunkIteratorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)ChunkIterator_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)ChunkIterator_next,
+};
+
+static int parse_region_args(const char *function, PyObject *const *args,
+                             Py_ssize_t nargs, PyObject *kwnames,
+                             PyObject **path, long *threads,
+                             ParseOptions *options) {
+  static const char *const names[] = {"path", "threads", OPTION_NAMES};
+  PyObject *argv[2 + OPTION_COUNT];
+  if (parse_fast_args(function, args, nargs, kwnames, names,
+                      2 + OPTION_COUNT, 1, 2, argv) < 0 ||
+      parse_options(function, argv + 2, NO_VARINT, options) < 0)
+    return -1;
+
+  *path = argv[0];
+  *threads = 0;
+  if (argv[1]) {
+    *threads = PyLong_AsLong(argv[1]);
+    if (*threads == -1 && PyErr_Occurred())
+      return -1;
+  }
+  return 0;
+}
+
+static ChunkIteratorObject *region_pool_new(const char *function,
+                                            PyObject *const *args,
+                                            Py_ssize_t nargs,
+                                            PyObject *kwnames) {
+  PyObject *path;
+  long threads;
+  ParseOptions options;
+  if (parse_region_args(function, args, nargs, kwnames, &path, &threads,
+                        &options) < 0)
+    return NULL;
+
+  PyObject *paths = PyList_New(1);
+  if (!paths)
+    return NULL;
+  Py_INCREF(path);
+  PyList_SET_ITEM(paths, 0, path);
+  return chunk_pool_new(paths, threads, &options, 0);
+}
+
+static PyObject *iter_region(PyObject *self, PyObject *const *args,
+                             Py_ssize_t nargs, PyObject *kwnames) {
+  return (PyObject *)region_pool_new("iter_region", args, nargs, kwnames);
+}
+
+static PyObject *parse_region(PyObject *self, PyObject *const *args,
+                              Py_ssize_t nargs, PyObject *kwnames) {
+  ChunkIteratorObject *pool =
+      region_pool_new("parse_region", args, nargs, kwnames);
+  if (!pool)
+    return NULL;
+
+  PyObject *result = PyList_New((Py_ssize_t)pool->count);
+  ChunkJob *job;
+  while (result && (job = chunk_pool_take(pool))) {
+    PyObject *item = chunk_pool_item(pool, job);
+    if (!item) {
+      Py_CLEAR(result);
+      break;
+    }
+    PyList_SET_ITEM(result, job - pool->jobs, item);
+  }
+  Py_DECREF(pool);
+  return result;
+}
+
+/* Every .mca file below path, sorted, as str paths. */
+static PyObject *world_region_paths(PyObject *path) {
+  PyObject *decoded, *glob = NULL, *escaped = NULL, *pattern = NULL;
+  PyObject *func = NULL, *call_args = NULL, *kwargs = NULL, *paths = NULL;
+  if (!PyUnicode_FSDecoder(path, &decoded))
+    return NULL;
+
+  if ((glob = PyImport_ImportModule("glob")) &&
+      (escaped = PyObject_CallMethod(glob, "escape", "O", decoded)) &&
+      (pattern = PyUnicode_FromFormat("%U/**/*.mca", escaped)) &&
+      (func = PyObject_GetAttrString(glob, "glob")) &&
+      (call_args = PyTuple_Pack(1, pattern)) &&
+      (kwargs = Py_BuildValue("{s:O}", "recursive", Py_True)))
+    paths = PyObject_Call(func, call_args, kwargs);
+
+  if (paths && (!PyList_Check(paths) || PyList_Sort(paths) < 0))
+    Py_CLEAR(paths);
+  Py_XDECREF(kwargs);
+  Py_XDECREF(call_args);
+  Py_XDECREF(func);
+  Py_XDECREF(pattern);
+  Py_XDECREF(escaped);
+  Py_XDECREF(glob);
+  Py_DECREF(decoded);
+  return paths;
+}
+
+static PyObject *iter_world(PyObject *self, PyObject *const *args,
+                            Py_ssize_t nargs, PyObject *kwnames) {
+  PyObject *path;
+  long threads;
+  ParseOptions options;
+  if (parse_region_args("iter_world", args, nargs, kwnames, &path, &threads,
+                        &options) < 0)
+    return NULL;
+
+  PyObject *paths = world_region_paths(path);
+  if (!paths)
+    return NULL;
+  return (PyObject *)chunk_pool_new(paths, threads, &options, 1);
+}
+
+static PyMethodDef methods[] = {
+    {"parse_nbt", (PyCFunction)(void (*)(void))parse_nbt,
+     METH_FASTCALL | METH_KEYWORDS,
      "Parses NBT binary data and returns a dictionary"},
+    {"parse_nbt_b64gz", (PyCFunction)(void (*)(void))parse_nbt_b64gz,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Decodes base64, inflates gzip and parses the NBT data in one call"},
+    {"parse_nbt_compressed", (PyCFunction)(void (*)(void))parse_nbt_compressed,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses gzip or zlib compressed NBT data while inflating it"},
+    {"parse_nbt_file", (PyCFunction)(void (*)(void))parse_nbt_file,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses an NBT file, compressed or not, from a read-only mapping"},
+    {"parse_many", (PyCFunction)(void (*)(void))parse_many,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses a list of NBT buffers across native threads and returns a list"},
+    {"parse_region", (PyCFunction)(void (*)(void))parse_region,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses every chunk of a region file across native threads and returns "
+     "a list of (x, z, chunk) in chunk order"},
+    {"iter_region", (PyCFunction)(void (*)(void))iter_region,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses a region file across native threads, yielding (x, z, chunk) "
+     "as chunks finish"},
+    {"iter_world", (PyCFunction)(void (*)(void))iter_world,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Parses every .mca file under a world directory across native threads, "
+     "yielding (path, x, z, chunk) as chunks finish"},
+    {"extract", (PyCFunction)(void (*)(void))extract,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Returns only the values at the given paths, e.g. 'i[].tag.display'"},
+    {"validate", (PyCFunction)(void (*)(void))validate,
+     METH_FASTCALL | METH_KEYWORDS,
+     "Checks the NBT structure without decoding it and returns its length"},
     {NULL, NULL, 0, NULL}};
 
 static struct PyModuleDef module = {PyModuleDef_HEAD_INIT, "nbt2dict",
                                     "Python C extension to efficiently decode NBT data into a dictionary",
                                     -1, methods};
 
-PyMODINIT_FUNC PyInit_nbt2dict(void) { return PyModule_Create(&module); }
+PyMODINIT_FUNC PyInit_nbt2dict(void) {
+  init_b64_table();
+  init_kernels();
+
+  if (PyType_Ready(&TapeType) < 0 || PyType_Ready(&LazyCompoundType) < 0 ||
+      PyType_Ready(&ParserType) < 0 ||
+      PyType_Ready(&IncrementalParserType) < 0 ||
+      PyType_Ready(&RegionFileType) < 0 ||
+      PyType_Ready(&ChunkIteratorType) < 0)
+    return NULL;
+
+  PyObject *m = PyModule_Create(&module);
+  if (!m)
+    return NULL;
+
+  Py_INCREF(&TapeType);
+  if (PyModule_AddObject(m, "Tape", (PyObject *)&TapeType) < 0) {
+    Py_DECREF(&TapeType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  if (PyModule_AddStringConstant(m, "simd", simd_names[kernels.level]) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  Py_INCREF(&LazyCompoundType);
+  if (PyModule_AddObject(m, "LazyCompound", (PyObject *)&LazyCompoundType) <
+      0) {
+    Py_DECREF(&LazyCompoundType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  Py_INCREF(&ParserType);
+  if (PyModule_AddObject(m, "Parser", (PyObject *)&ParserType) < 0) {
+    Py_DECREF(&ParserType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  Py_INCREF(&IncrementalParserType);
+  if (PyModule_AddObject(m, "IncrementalParser",
+                         (PyObject *)&IncrementalParserType) < 0) {
+    Py_DECREF(&IncrementalParserType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  Py_INCREF(&RegionFileType);
+  if (PyModule_AddObject(m, "RegionFile", (PyObject *)&RegionFileType) < 0) {
+    Py_DECREF(&RegionFileType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  PyObject *abc = PyImport_ImportModule("collections.abc");
+  PyObject *mapping = abc ? PyObject_GetAttrString(abc, "Mapping") : NULL;
+  PyObject *registered =
+      mapping ? PyObject_CallMethod(mapping, "register", "O",
+                                    (PyObject *)&LazyCompoundType)
+              : NULL;
+  Py_XDECREF(mapping);
+  Py_XDECREF(abc);
+  if (!registered) {
+    Py_DECREF(m);
+    return NULL;
+  }
+  Py_DECREF(registered);
+  return m;
+}
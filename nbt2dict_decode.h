@@ -0,0 +1,662 @@
+/* Encoding specific readers and the tag decoder. nbt2dict.c includes this
+   file three times: with NBT_BIG_ENDIAN set to 1 (Java) and 0 (Bedrock
+   files), and once more with NBT_VARINT defined (Bedrock network NBT, where
+   ints, longs and lengths are varints). Every function gets a _be, _le or
+   _net suffix through NBT_FN, so no instantiation checks the encoding per
+   read. */
+
+#ifdef NBT_VARINT
+#define NBT_FN(name) name##_net
+#define FROM_NBT16(val) (val)
+#define FROM_NBT32(val) (val)
+#define FROM_NBT64(val) (val)
+#elif NBT_BIG_ENDIAN
+#define NBT_FN(name) name##_be
+#define FROM_NBT16(val) swap16(val)
+#define FROM_NBT32(val) swap32(val)
+#define FROM_NBT64(val) swap64(val)
+#else
+#define NBT_FN(name) name##_le
+#define FROM_NBT16(val) (val)
+#define FROM_NBT32(val) (val)
+#define FROM_NBT64(val) (val)
+#endif
+
+static inline uint16_t NBT_FN(load_u16)(const uint8_t *src) {
+  uint16_t val;
+  memcpy(&val, src, 2);
+  return FROM_NBT16(val);
+}
+
+static inline int16_t NBT_FN(load_short)(const uint8_t *src) {
+  return (int16_t)NBT_FN(load_u16)(src);
+}
+
+static inline int32_t NBT_FN(load_int)(const uint8_t *src) {
+  uint32_t val;
+  memcpy(&val, src, 4);
+  return (int32_t)FROM_NBT32(val);
+}
+
+static inline int64_t NBT_FN(load_long)(const uint8_t *src) {
+  uint64_t val;
+  memcpy(&val, src, 8);
+  return (int64_t)FROM_NBT64(val);
+}
+
+static inline float NBT_FN(load_float)(const uint8_t *src) {
+  uint32_t val;
+  memcpy(&val, src, 4);
+  val = FROM_NBT32(val);
+  float out;
+  memcpy(&out, &val, 4);
+  return out;
+}
+
+static inline double NBT_FN(load_double)(const uint8_t *src) {
+  uint64_t val;
+  memcpy(&val, src, 8);
+  val = FROM_NBT64(val);
+  double out;
+  memcpy(&out, &val, 8);
+  return out;
+}
+
+#define READ_SCALAR(name, type, size)                                          \
+  static int NBT_FN(read_##name)(NBTParser * parser, type * out) {             \
+    if (need(parser, size) < 0)                                                \
+      return -1;                                                               \
+    *out = NBT_FN(load_##name)(parser->data + parser->pos);                    \
+    parser->pos += size;                                                       \
+    return 0;                                                                  \
+  }
+
+READ_SCALAR(short, int16_t, 2)
+READ_SCALAR(float, float, 4)
+READ_SCALAR(double, double, 8)
+
+#ifdef NBT_VARINT
+static int NBT_FN(read_varint)(NBTParser *parser, size_t max_bytes,
+                               uint64_t *out) {
+  if (parser->source && parser->length - parser->pos < max_bytes &&
+      source_fill(parser, max_bytes) < 0)
+    return -1;
+
+  size_t avail = parser->length - parser->pos;
+  size_t length =
+      uvarint_decode(parser->data + parser->pos, avail, max_bytes, out);
+  if (!length) {
+    parser->starved = avail < max_bytes;
+    PyErr_SetString(PyExc_ValueError, parser->starved
+                                          ? "Unexpected end of data"
+                                          : "Invalid varint");
+    return -1;
+  }
+  parser->pos += length;
+  return 0;
+}
+
+static int NBT_FN(read_int)(NBTParser *parser, int32_t *out) {
+  uint64_t val;
+  if (NBT_FN(read_varint)(parser, 5, &val) < 0)
+    return -1;
+  *out = zigzag32((uint32_t)val);
+  return 0;
+}
+
+static int NBT_FN(read_long)(NBTParser *parser, int64_t *out) {
+  uint64_t val;
+  if (NBT_FN(read_varint)(parser, 10, &val) < 0)
+    return -1;
+  *out = zigzag64(val);
+  return 0;
+}
+
+static int NBT_FN(read_length)(NBTParser *parser, size_t *out) {
+  uint64_t val;
+  if (NBT_FN(read_varint)(parser, 5, &val) < 0)
+    return -1;
+  *out = (uint32_t)val;
+  return 0;
+}
+#else
+READ_SCALAR(u16, uint16_t, 2)
+READ_SCALAR(int, int32_t, 4)
+READ_SCALAR(long, int64_t, 8)
+
+static int NBT_FN(read_length)(NBTParser *parser, size_t *out) {
+  uint16_t val;
+  if (NBT_FN(read_u16)(parser, &val) < 0)
+    return -1;
+  *out = val;
+  return 0;
+}
+#endif
+
+#undef READ_SCALAR
+
+#ifdef NBT_VARINT
+/* Every varint takes at least one byte, so the run is checked against the
+   remaining data once up front; each element is then only bounded by the
+   end of the buffer inside uvarint_decode. */
+static PyObject *NBT_FN(read_varint_list)(NBTParser *parser, uint8_t elem_type,
+                                          int32_t length) {
+  if (need(parser, (size_t)length) < 0)
+    return NULL;
+
+  PyObject *list = PyList_New(length);
+  if (!list)
+    return NULL;
+
+  for (int32_t i = 0; i < length; i++) {
+    PyObject *item = NULL;
+    if (elem_type == TAG_INT) {
+      int32_t val;
+      if (NBT_FN(read_int)(parser, &val) == 0)
+        item = PyLong_FromLong(val);
+    } else {
+      int64_t val;
+      if (NBT_FN(read_long)(parser, &val) == 0)
+        item = PyLong_FromLongLong(val);
+    }
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+static PyObject *NBT_FN(read_number_array)(NBTParser *parser,
+                                           uint8_t tag_type, int32_t length) {
+  uint8_t elem_type = tag_type == TAG_INT_ARRAY ? TAG_INT : TAG_LONG;
+  if (parser->array_mode == ARRAYS_LIST)
+    return NBT_FN(read_varint_list)(parser, elem_type, length);
+
+  size_t size = fixed_payload_size(elem_type);
+  if (need(parser, (size_t)length) < 0)
+    return NULL;
+
+  PyObject *storage = typed_array_storage(parser, (size_t)length * size);
+  if (!storage)
+    return NULL;
+
+  char *dst = PyByteArray_AS_STRING(storage);
+  for (int32_t i = 0; i < length; i++, dst += size) {
+    int32_t val32;
+    int64_t val64;
+    int status = elem_type == TAG_INT ? NBT_FN(read_int)(parser, &val32)
+                                      : NBT_FN(read_long)(parser, &val64);
+    if (status < 0) {
+      Py_DECREF(storage);
+      return NULL;
+    }
+    if (elem_type == TAG_INT)
+      memcpy(dst, &val32, 4);
+    else
+      memcpy(dst, &val64, 8);
+  }
+  return typed_array_wrap(parser, storage, size);
+}
+#else
+static PyObject *NBT_FN(read_number_array)(NBTParser *parser,
+                                           uint8_t tag_type, int32_t length) {
+  if (parser->array_mode != ARRAYS_LIST)
+    return read_typed_array(parser, tag_type, length, NBT_BIG_ENDIAN);
+  return tag_type == TAG_INT_ARRAY
+             ? read_int_array_list(parser, length, NBT_BIG_ENDIAN)
+             : read_long_array_list(parser, length, NBT_BIG_ENDIAN);
+}
+#endif
+
+/* Builds the value of a fixed-size scalar from already bounds-checked
+   bytes. */
+static inline PyObject *NBT_FN(load_scalar)(uint8_t tag_type,
+                                            const uint8_t *src) {
+  switch (tag_type) {
+  case TAG_BYTE:
+    return PyLong_FromLong((int8_t)*src);
+  case TAG_SHORT:
+    return PyLong_FromLong(NBT_FN(load_short)(src));
+  case TAG_INT:
+    return PyLong_FromLong(NBT_FN(load_int)(src));
+  case TAG_LONG:
+    return PyLong_FromLongLong(NBT_FN(load_long)(src));
+  case TAG_FLOAT:
+    return PyFloat_FromDouble(NBT_FN(load_float)(src));
+  default:
+    return PyFloat_FromDouble(NBT_FN(load_double)(src));
+  }
+}
+
+/* Lists of fixed-size scalars are bounds-checked once for the whole run and
+   then decoded with unchecked loads. */
+static PyObject *NBT_FN(read_scalar_list)(NBTParser *parser, uint8_t elem_type,
+                                          int32_t length) {
+#ifdef NBT_VARINT
+  if (elem_type == TAG_INT || elem_type == TAG_LONG)
+    return NBT_FN(read_varint_list)(parser, elem_type, length);
+#endif
+  size_t size = fixed_payload_size(elem_type);
+  if (need(parser, (size_t)length * size) < 0)
+    return NULL;
+
+  PyObject *list = PyList_New(length);
+  if (!list)
+    return NULL;
+
+  const uint8_t *src = parser->data + parser->pos;
+  for (int32_t i = 0; i < length; i++, src += size) {
+    PyObject *item = NBT_FN(load_scalar)(elem_type, src);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+
+  parser->pos += (size_t)length * size;
+  return list;
+}
+
+static int NBT_FN(read_key_bytes)(NBTParser *parser, const uint8_t **data,
+                                  size_t *length) {
+  if (NBT_FN(read_length)(parser, length) < 0 || need(parser, *length) < 0)
+    return -1;
+
+  *data = parser->data + parser->pos;
+  parser->pos += *length;
+  return 0;
+}
+
+static PyObject *NBT_FN(read_string)(NBTParser *parser) {
+  const uint8_t *data;
+  size_t length;
+  if (NBT_FN(read_key_bytes)(parser, &data, &length) < 0)
+    return NULL;
+  return decode_string(data, length);
+}
+
+static PyObject *NBT_FN(read_key)(NBTParser *parser) {
+  const uint8_t *data;
+  size_t length;
+  if (NBT_FN(read_key_bytes)(parser, &data, &length) < 0)
+    return NULL;
+  return key_cache_get(parser->cache, data, length);
+}
+
+/* Reads the type and name of the next child of a compound, taking the key
+   from the compound's predicted shape when the name matches it. Returns 1
+   at TAG_End, after recording the finished shape. */
+static inline int NBT_FN(read_child_header)(NBTParser *parser,
+                                            DecodeFrame *frame,
+                                            uint8_t *tag_type) {
+  if (read_byte(parser, tag_type) < 0)
+    return -1;
+
+  Shape *shape = frame->shape;
+  if (*tag_type == TAG_END) {
+    if (frame->hit && frame->index == shape->count) {
+      parser->cache->shape_hits++;
+    } else {
+      parser->cache->shape_misses++;
+      shape_store(shape, frame->container);
+    }
+    return 1;
+  }
+
+  const uint8_t *name = NULL;
+  size_t name_length = 0;
+  if (NBT_FN(read_key_bytes)(parser, &name, &name_length) < 0)
+    return -1;
+
+  Py_ssize_t i = frame->index;
+  if (frame->hit && i < shape->count &&
+      (size_t)shape->lengths[i] == name_length &&
+      memcmp(shape->names[i], name, name_length) == 0) {
+    frame->key = shape->keys[i];
+    Py_INCREF(frame->key);
+  } else {
+    frame->hit = 0;
+    frame->key = key_cache_get(parser->cache, name, name_length);
+    if (!frame->key)
+      return -1;
+  }
+  return 0;
+}
+
+#ifdef NBT_COMPUTED_GOTO
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    mark = parser->pos;                                                        \
+    if (tag_type > TAG_TBD)                                                    \
+      goto target_unknown;                                                     \
+    goto *targets[tag_type];                                                   \
+  } while (0)
+#else
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    mark = parser->pos;                                                        \
+    goto dispatch;                                                             \
+  } while (0)
+#endif
+#define TARGET(tag)                                                            \
+  case tag:                                                                    \
+  target_##tag
+
+/* Decodes one tag without recursing: lists and compounds push a frame and
+   their children are dispatched from the same loop, so nesting is bounded
+   by max_depth rather than the C stack. With parser->resume set, running out
+   of input rolls back to the start of the current value (or child header)
+   and parks the frames there instead of failing; the next call picks them
+   up again. */
+static PyObject *NBT_FN(read_tag_payload)(NBTParser *parser,
+                                           uint8_t tag_type) {
+#ifdef NBT_COMPUTED_GOTO
+  static void *const targets[] = {
+      &&target_TAG_END,       &&target_TAG_BYTE,      &&target_TAG_SHORT,
+      &&target_TAG_INT,       &&target_TAG_LONG,      &&target_TAG_FLOAT,
+      &&target_TAG_DOUBLE,    &&target_TAG_BYTE_ARRAY, &&target_TAG_STRING,
+      &&target_TAG_LIST,      &&target_TAG_COMPOUND,  &&target_TAG_INT_ARRAY,
+      &&target_TAG_LONG_ARRAY, &&target_TAG_TBD};
+#endif
+
+  DecodeStack stack;
+  DecodeFrame *frame;
+  PyObject *value;
+  int32_t length;
+  size_t mark;
+  int in_header = 0;
+
+  if (parser->resume && parser->resume->active)
+    goto resume;
+
+  stack.frames = stack.small;
+  stack.depth = 0;
+  stack.capacity = DECODE_STACK_INLINE;
+  DISPATCH();
+#ifndef NBT_COMPUTED_GOTO
+dispatch:
+#endif
+  switch (tag_type) {
+  TARGET(TAG_END):
+    value = Py_None;
+    Py_INCREF(value);
+    goto emit;
+
+  TARGET(TAG_BYTE): {
+    uint8_t val = 0;
+    if (read_byte(parser, &val) < 0)
+      goto error;
+    value = PyLong_FromLong((int8_t)val);
+    goto emit;
+  }
+
+  TARGET(TAG_SHORT): {
+    int16_t val;
+    if (NBT_FN(read_short)(parser, &val) < 0)
+      goto error;
+    value = PyLong_FromLong(val);
+    goto emit;
+  }
+
+  TARGET(TAG_INT): {
+    int32_t val;
+    if (NBT_FN(read_int)(parser, &val) < 0)
+      goto error;
+    value = PyLong_FromLong(val);
+    goto emit;
+  }
+
+  TARGET(TAG_LONG): {
+    int64_t val;
+    if (NBT_FN(read_long)(parser, &val) < 0)
+      goto error;
+    value = PyLong_FromLongLong(val);
+    goto emit;
+  }
+
+  TARGET(TAG_FLOAT): {
+    float val;
+    if (NBT_FN(read_float)(parser, &val) < 0)
+      goto error;
+    value = PyFloat_FromDouble(val);
+    goto emit;
+  }
+
+  TARGET(TAG_DOUBLE): {
+    double val;
+    if (NBT_FN(read_double)(parser, &val) < 0)
+      goto error;
+    value = PyFloat_FromDouble(val);
+    goto emit;
+  }
+
+  TARGET(TAG_BYTE_ARRAY):
+    if (NBT_FN(read_int)(parser, &length) < 0)
+      goto error;
+
+    if (length < 0) {
+      PyErr_Format(PyExc_ValueError, "Invalid array length: %d", length);
+      goto error;
+    }
+
+    if (parser->array_mode != ARRAYS_LIST) {
+      value = read_typed_array(parser, tag_type, length, NBT_BIG_ENDIAN);
+      goto emit;
+    }
+
+    value = NBT_FN(read_scalar_list)(parser, TAG_BYTE, length);
+    goto emit;
+
+  TARGET(TAG_STRING):
+    value = NBT_FN(read_string)(parser);
+    goto emit;
+
+  TARGET(TAG_LIST): {
+    uint8_t elem_type = TAG_END;
+    if (read_byte(parser, &elem_type) < 0 ||
+        NBT_FN(read_int)(parser, &length) < 0)
+      goto error;
+
+    if (length < 0) {
+      PyErr_Format(PyExc_ValueError, "Invalid list length: %d", length);
+      goto error;
+    }
+
+    if (elem_type == TAG_END && length != 0) {
+      PyErr_SetString(PyExc_ValueError,
+                      "List has element type TAG_End but non-zero length");
+      goto error;
+    }
+
+    if (fixed_payload_size(elem_type)) {
+      value = NBT_FN(read_scalar_list)(parser, elem_type, length);
+      goto emit;
+    }
+
+    /* Every element takes at least one byte, so a corrupt length fails
+       here instead of allocating a list the data cannot fill. */
+    if (need(parser, (size_t)length) < 0)
+      goto error;
+    value = PyList_New(length);
+    if (!value || length == 0)
+      goto emit;
+
+    frame = stack_push(parser, &stack);
+    if (!frame) {
+      Py_DECREF(value);
+      goto error;
+    }
+    frame->container = value;
+    frame->key = NULL;
+    frame->index = 0;
+    frame->length = length;
+    frame->kind = TAG_LIST;
+    frame->elem_type = elem_type;
+    tag_type = elem_type;
+    DISPATCH();
+  }
+
+  TARGET(TAG_COMPOUND): {
+    if (parser->lazy_view) {
+      value = read_lazy_compound(parser, parser->base_depth + stack.depth);
+      goto emit;
+    }
+
+    uint8_t child_tag = TAG_END;
+    if (read_byte(parser, &child_tag) < 0)
+      goto error;
+    if (child_tag == TAG_END) {
+      value = PyDict_New();
+      goto emit;
+    }
+
+    /* Compounds in a corpus mostly repeat a few layouts, so the key
+       sequence of the previous compound with the same first key is used to
+       presize the dict and to match the following keys without decoding
+       them. */
+    PyObject *key = NBT_FN(read_key)(parser);
+    if (!key)
+      goto error;
+
+    Shape *shape = shape_slot(parser->cache, key);
+    int hit = shape->count > 0 && shape->keys[0] == key;
+    value = hit ? dict_new_presized(shape->count) : PyDict_New();
+    frame = value ? stack_push(parser, &stack) : NULL;
+    if (!frame) {
+      Py_XDECREF(value);
+      Py_DECREF(key);
+      goto error;
+    }
+    frame->container = value;
+    frame->key = key;
+    frame->shape = shape;
+    frame->index = 0;
+    frame->kind = TAG_COMPOUND;
+    frame->hit = (uint8_t)hit;
+    tag_type = child_tag;
+    DISPATCH();
+  }
+
+  TARGET(TAG_INT_ARRAY):
+  TARGET(TAG_LONG_ARRAY):
+    if (NBT_FN(read_int)(parser, &length) < 0)
+      goto error;
+
+    if (length < 0) {
+      PyErr_Format(PyExc_ValueError, "Invalid array length: %d", length);
+      goto error;
+    }
+
+    value = NBT_FN(read_number_array)(parser, tag_type, length);
+    goto emit;
+
+  TARGET(TAG_TBD):
+    if (read_byte(parser, &tag_type) < 0)
+      goto error;
+    if (tag_type == TAG_TBD)
+      goto target_unknown;
+    DISPATCH();
+
+  default:
+  target_unknown:
+    PyErr_Format(PyExc_ValueError, "Unknown tag type: %d", tag_type);
+    goto error;
+  }
+
+emit:
+  if (!value)
+    goto error;
+  if (stack.depth == 0) {
+    stack_free(&stack);
+    return value;
+  }
+
+  frame = &stack.frames[stack.depth - 1];
+  if (frame->kind == TAG_LIST) {
+    PyList_SET_ITEM(frame->container, frame->index++, value);
+    if (frame->index < frame->length) {
+      tag_type = frame->elem_type;
+      DISPATCH();
+    }
+  } else {
+    int status = PyDict_SetItem(frame->container, frame->key, value);
+    Py_DECREF(value);
+    Py_CLEAR(frame->key);
+    if (status < 0)
+      goto error;
+    frame->index++;
+
+    mark = parser->pos;
+    in_header = 1;
+    status = NBT_FN(read_child_header)(parser, frame, &tag_type);
+    if (status < 0)
+      goto error;
+    in_header = 0;
+    if (status == 0)
+      DISPATCH();
+  }
+
+  value = frame->container;
+  stack.depth--;
+  goto emit;
+
+resume:
+  parser->resume->active = 0;
+  stack_move(&stack, &parser->resume->stack);
+  tag_type = parser->resume->tag_type;
+  if (!parser->resume->in_header)
+    DISPATCH();
+
+  frame = &stack.frames[stack.depth - 1];
+  mark = parser->pos;
+  in_header = 1;
+  int status = NBT_FN(read_child_header)(parser, frame, &tag_type);
+  if (status < 0)
+    goto error;
+  in_header = 0;
+  if (status == 0)
+    DISPATCH();
+  value = frame->container;
+  stack.depth--;
+  goto emit;
+
+error:
+  if (parser->resume && parser->starved) {
+    PyErr_Clear();
+    parser->pos = mark;
+    parser->resume->tag_type = tag_type;
+    parser->resume->in_header = (uint8_t)in_header;
+    parser->resume->active = 1;
+    stack_move(&parser->resume->stack, &stack);
+    return NULL;
+  }
+  stack_free(&stack);
+  return NULL;
+}
+
+/* The root name is skipped without being decoded. Java network NBT (1.20.2+
+   packets) omits it entirely. */
+static PyObject *NBT_FN(parse_root)(NBTParser *parser) {
+  uint8_t root_type;
+  if (read_byte(parser, &root_type) < 0)
+    return NULL;
+
+  if (!parser->nameless_root) {
+    const uint8_t *name;
+    size_t length;
+    if (NBT_FN(read_key_bytes)(parser, &name, &length) < 0)
+      return NULL;
+  }
+
+  return NBT_FN(read_tag_payload)(parser, root_type);
+}
+
+#undef DISPATCH
+#undef TARGET
+#undef NBT_FN
+#undef FROM_NBT16
+#undef FROM_NBT32
+#undef FROM_NBT64
@@ -1,5 +1,7 @@
 from setuptools import setup, Extension
 
-nbt2dict_extension = Extension("nbt2dict", ["nbt2dict.c"])
+nbt2dict_extension = Extension(
+    "nbt2dict", ["nbt2dict.c"], depends=["nbt2dict_decode.h"], libraries=["z"]
+)
 
 setup(ext_modules=[nbt2dict_extension])
@@ -0,0 +1,1576 @@
+import base64
+import collections.abc
+import gc
+import gzip
+import os
+import pathlib
+import struct
+import subprocess
+import sys
+import tempfile
+import textwrap
+import unittest
+import zlib
+
+import nbt2dict
+from nbt2dict import (IncrementalParser, Parser, RegionFile, Tape, extract,
+                      iter_region, iter_world, parse_many, parse_nbt,
+                      parse_nbt_b64gz, parse_nbt_compressed, parse_nbt_file,
+                      parse_region, validate)
+
+
+def mutf8(text):
+    out = bytearray()
+    for unit in text.encode("utf-16-be", "surrogatepass").hex(" ", 2).split():
+        code = int(unit, 16)
+        if 0 < code < 0x80:
+            out.append(code)
+        elif code < 0x800:
+            out += bytes([0xC0 | code >> 6, 0x80 | code & 0x3F])
+        else:
+            out += bytes([0xE0 | code >> 12, 0x80 | code >> 6 & 0x3F,
+                          0x80 | code & 0x3F])
+    return bytes(out)
+
+
+class Writer:
+    """Builds NBT documents: values are (tag_type, payload) pairs."""
+
+    def __init__(self, little_endian=False, encode=mutf8):
+        self.order = "<" if little_endian else ">"
+        self.encode = encode
+
+    def pack(self, fmt, *values):
+        return struct.pack(self.order + fmt, *values)
+
+    def name(self, text):
+        data = self.encode(text)
+        return self.pack("H", len(data)) + data
+
+    def payload(self, tag_type, value):
+        if tag_type in (1, 2, 3, 4, 5, 6):
+            return self.pack("_bhiqfd"[tag_type], value)
+        if tag_type == 8:
+            return self.name(value)
+        if tag_type in (7, 11, 12):
+            fmt = {7: "b", 11: "i", 12: "q"}[tag_type]
+            return self.pack("i%d%s" % (len(value), fmt), len(value), *value)
+        if tag_type == 9:
+            elem_type, items = value
+            return bytes([elem_type]) + self.pack("i", len(items)) + b"".join(
+                self.payload(elem_type, item) for item in items)
+        return b"".join(bytes([child_type]) + self.name(key) +
+                        self.payload(child_type, child)
+                        for key, (child_type, child) in value.items()) + b"\0"
+
+    def root(self, compound, name=""):
+        return b"\x0a" + self.name(name) + self.payload(10, compound)
+
+
+SIMD_LEVELS = ("scalar", "ssse3", "avx2", "avx512")
+
+
+def run_at_simd_levels(test, script):
+    """Runs script in a fresh interpreter with NBT2DICT_SIMD set to each
+    level; levels the CPU lacks fall back to the best one it has."""
+    path = [os.path.dirname(os.path.abspath(nbt2dict.__file__)),
+            os.path.dirname(os.path.abspath(__file__))]
+    for level in SIMD_LEVELS:
+        env = dict(os.environ, NBT2DICT_SIMD=level,
+                   PYTHONPATH=os.pathsep.join(path))
+        result = subprocess.run([sys.executable, "-c",
+                                 textwrap.dedent(script)],
+                                env=env, capture_output=True, text=True)
+        test.assertEqual(result.returncode, 0, level + "\n" + result.stderr)
+
+
+class SpecialKeyTest(unittest.TestCase):
+    """Lookups compare the key's encoded form against the raw tag names."""
+
+    KEYS = ["a\x00b", "\U0001F600", "plain"]
+
+    def document(self, writer):
+        inner = {key: (3, i) for i, key in enumerate(self.KEYS)}
+        return writer.root({key: (10, inner) for key in self.KEYS})
+
+    def test_lazy_lookup(self):
+        for writer in (Writer(), Writer(encode=lambda text: text.encode())):
+            data = self.document(writer)
+            expected = parse_nbt(data)
+            root = parse_nbt(data, lazy=True)
+            self.assertEqual(dict(root["a\x00b"]), expected["a\x00b"])
+            for i, key in enumerate(self.KEYS):
+                self.assertIn(key, root)
+                self.assertEqual(root[key][key], i)
+                self.assertEqual(root.get(key).get(key), i)
+            self.assertEqual(root.to_dict(), expected)
+
+    def test_little_endian_lazy_lookup(self):
+        writer = Writer(little_endian=True, encode=lambda text: text.encode())
+        root = parse_nbt(self.document(writer), endian="little", lazy=True)
+        self.assertEqual(root["\U0001F600"]["a\x00b"], 0)
+
+    def test_tape_get(self):
+        tape = Tape(self.document(Writer()))
+        for i, key in enumerate(self.KEYS):
+            self.assertEqual(tape.get([key, key]), i)
+        self.assertEqual(tape.get(["a\x00c"], "missing"), "missing")
+
+    def test_extract(self):
+        data = self.document(Writer())
+        self.assertEqual(
+            extract(data, ["a\x00b.\U0001F600", "\U0001F600.a\x00b"]), [1, 0])
+
+
+class LittleEndianTest(unittest.TestCase):
+    """Bedrock's byte order reaches every decoder, tape and skip path."""
+
+    DOC = {
+        "name": (8, "Steve\u00e9"),
+        "pos": (9, (6, [1.5, -2.25, 64.0])),
+        "inv": (9, (10, [{"id": (8, "stone"), "n": (1, 3)},
+                         {"id": (8, "dirt"), "n": (1, 7)}])),
+        "stats": (10, {"hp": (2, 20), "xp": (4, 1 << 40), "f": (5, 0.5)}),
+        "ints": (11, [1, -2, 1 << 30]),
+        "longs": (12, [-1, 1 << 50]),
+        "bytes": (7, [1, -1]),
+    }
+
+    def setUp(self):
+        self.data = Writer(little_endian=True,
+                           encode=lambda text: text.encode()).root(self.DOC)
+        self.expected = parse_nbt(Writer().root(self.DOC))
+
+    def test_parse(self):
+        self.assertEqual(parse_nbt(self.data, endian="little"), self.expected)
+        root = parse_nbt(self.data, endian="little", lazy=True)
+        self.assertEqual(root["stats"]["xp"], 1 << 40)
+        self.assertEqual(root.to_dict(), self.expected)
+
+    def test_tape(self):
+        tape = Tape(self.data, endian="little")
+        self.assertEqual(tape.materialize(), self.expected)
+        self.assertEqual(tape.get(["inv", 1, "id"]), "dirt")
+        self.assertEqual(tape.get(["longs", 1]), 1 << 50)
+        self.assertEqual(tape.get(["stats", "hp"]), 20)
+
+    def test_extract(self):
+        self.assertEqual(
+            extract(self.data, ["inv[].n", "pos[2]", "stats.f"],
+                    endian="little"), [[3, 7], 64.0, 0.5])
+
+    def test_validate(self):
+        self.assertEqual(validate(self.data, endian="little"), len(self.data))
+        with self.assertRaises(ValueError):
+            validate(self.data)
+
+    def test_parse_many(self):
+        for threads in (1, 3):
+            self.assertEqual(
+                parse_many([self.data] * 5, threads=threads, endian="little"),
+                [self.expected] * 5)
+
+    def test_typed_arrays(self):
+        root = parse_nbt(self.data, endian="little", arrays="memoryview")
+        self.assertEqual(root["ints"].tolist(), [1, -2, 1 << 30])
+        self.assertEqual(root["longs"].tolist(), [-1, 1 << 50])
+
+    def test_compressed(self):
+        packed = gzip.compress(self.data)
+        self.assertEqual(parse_nbt_compressed(packed, endian="little"),
+                         self.expected)
+        self.assertEqual(
+            parse_nbt_b64gz(base64.b64encode(packed), endian="little"),
+            self.expected)
+        parser = Parser(endian="little")
+        self.assertEqual(parser.parse_compressed(packed), self.expected)
+        self.assertEqual(parser.parse(self.data), self.expected)
+
+    def test_varint_rejected(self):
+        for call in (lambda: Tape(self.data, varint=True),
+                     lambda: extract(self.data, "name", varint=True),
+                     lambda: validate(self.data, varint=True)):
+            with self.assertRaisesRegex(ValueError, "varint"):
+                call()
+
+
+class CompressedStreamTest(unittest.TestCase):
+    """The inflate window grows with the output, not with length prefixes."""
+
+    def test_truncated_huge_array(self):
+        data = b"\x0a\x00\x00\x0c\x00\x01a" + struct.pack(">i", 2**31 - 1)
+        for packed in (gzip.compress(data), zlib.compress(data)):
+            with self.assertRaisesRegex(ValueError, "Unexpected end of data"):
+                parse_nbt_compressed(packed)
+            with self.assertRaisesRegex(ValueError, "Unexpected end of data"):
+                Parser().parse_compressed(packed)
+
+    def test_large_array(self):
+        data = Writer().root({"a": (12, list(range(100000))), "b": (8, "x")})
+        self.assertEqual(parse_nbt_compressed(gzip.compress(data)),
+                         parse_nbt(data))
+
+
+class Reentrant:
+    """Runs `call` from __del__ once the collector finds this cycle."""
+
+    def __init__(self, call, results):
+        self.call = call
+        self.results = results
+        self.cycle = self
+
+    def __del__(self):
+        self.results.append(self.call())
+
+
+class ReentrantCallTest(unittest.TestCase):
+    """A call made from __del__ mid-parse must not share the outer buffers."""
+
+    # the nested document is the smaller one, so it lands on top of the
+    # outer one instead of moving a shared buffer
+    OUTER = Writer().root({"other": (9, (10, [
+        {"k": (8, "x" * (i % 50)), "v": (9, (4, [i] * 3))}
+        for i in range(3000)]))})
+    INNER = Writer().root({"items": (9, (10, [
+        {"id": (8, "stone%d" % i), "n": (9, (3, [i, i]))}
+        for i in range(3000)]))})
+
+    def check_nested(self, call, encode):
+        outer, inner = encode(self.OUTER), encode(self.INNER)
+        results = []
+        threshold = gc.get_threshold()
+        gc.disable()
+        gc.set_threshold(1)
+        try:
+            Reentrant(lambda: call(inner), results)
+            gc.enable()
+            root = call(outer)
+        finally:
+            gc.set_threshold(*threshold)
+            gc.enable()
+        self.assertEqual(results, [parse_nbt(self.INNER)])
+        self.assertEqual(root, parse_nbt(self.OUTER))
+
+    def test_parse_compressed(self):
+        self.check_nested(parse_nbt_compressed, gzip.compress)
+        self.check_nested(Parser().parse_compressed, zlib.compress)
+        self.check_nested(Parser(lazy=True).parse_compressed, gzip.compress)
+
+    def test_parse_b64gz(self):
+        def encode(data):
+            return base64.b64encode(gzip.compress(data))
+        self.check_nested(parse_nbt_b64gz, encode)
+        self.check_nested(Parser().parse_b64gz, encode)
+
+    def test_parse_file(self):
+        with tempfile.TemporaryDirectory() as directory:
+            def encode(data):
+                path = os.path.join(directory, "%d.dat" % len(data))
+                with open(path, "wb") as f:
+                    f.write(gzip.compress(data))
+                return path
+            self.check_nested(parse_nbt_file, encode)
+            self.check_nested(Parser().parse_file, encode)
+
+
+class IncrementalParserTest(unittest.TestCase):
+    """Every split of a document decodes the same as parse_nbt."""
+
+    NESTED = {
+        "list": (9, (10, [{"a": (1, 1), "b": (9, (3, [1, 2]))}, {}])),
+        "lists": (9, (9, [(8, ["x", "y"]), (0, []), (6, [1.5])])),
+        "compound": (10, {"inner": (10, {"deep": (4, -1)}), "s": (2, 7)}),
+        "after": (8, "end"),
+    }
+    STRING = {"text": (8, "\u00e9t\u00e9 \u4e2d\u6587 " * 8)}
+    ARRAYS = {"bytes": (7, list(range(-64, 64))),
+              "ints": (11, list(range(0, 1 << 30, 1 << 25))),
+              "longs": (12, [-1, 0, 1 << 40, 7])}
+
+    def check_splits(self, data):
+        expected = parse_nbt(data)
+        for split in range(len(data) + 1):
+            stream = IncrementalParser()
+            roots = stream.feed(data[:split]) + stream.feed(data[split:])
+            self.assertEqual(roots, [expected], split)
+            self.assertFalse(stream.pending)
+
+    def check_bytewise(self, data):
+        stream = IncrementalParser()
+        roots = []
+        for i in range(len(data)):
+            roots += stream.feed(data[i:i + 1])
+        self.assertEqual(roots, [parse_nbt(data)])
+
+    def test_nested(self):
+        data = Writer().root(self.NESTED, name="root")
+        self.check_splits(data)
+        self.check_bytewise(data)
+
+    def test_mid_string(self):
+        data = Writer().root(self.STRING)
+        self.check_splits(data)
+        self.check_bytewise(data)
+
+    def test_mid_array(self):
+        data = Writer().root(self.ARRAYS)
+        self.check_splits(data)
+        self.check_bytewise(data)
+
+    def test_consecutive_roots(self):
+        first = Writer().root(self.NESTED)
+        second = Writer().root(self.ARRAYS)
+        stream = IncrementalParser()
+        for split in range(len(first) + len(second) + 1):
+            data = first + second
+            roots = stream.feed(data[:split]) + stream.feed(data[split:])
+            self.assertEqual(roots, [parse_nbt(first), parse_nbt(second)])
+
+
+class OptionsTest(unittest.TestCase):
+    """Every entry point takes the same keyword options."""
+
+    DOC = {"a": (10, {"b": (10, {"c": (3, 5)})}), "s": (8, "x")}
+
+    def setUp(self):
+        writer = Writer()
+        self.data = writer.root(self.DOC)
+        self.nameless = b"\x0a" + writer.payload(10, self.DOC)
+        self.expected = parse_nbt(self.data)
+
+    def test_max_depth(self):
+        for threads in (1, 3):
+            with self.assertRaises(ValueError):
+                parse_many([self.data] * 3, threads=threads, max_depth=2)
+        packed = gzip.compress(self.data)
+        for call in (lambda: parse_nbt(self.data, max_depth=2),
+                     lambda: parse_nbt_compressed(packed, max_depth=2),
+                     lambda: parse_nbt_b64gz(base64.b64encode(packed),
+                                             max_depth=2),
+                     lambda: Tape(self.data, max_depth=2),
+                     lambda: validate(self.data, max_depth=2)):
+            with self.assertRaises(ValueError):
+                call()
+
+    def test_lazy(self):
+        packed = gzip.compress(self.data)
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "level.dat")
+            with open(path, "wb") as f:
+                f.write(packed)
+            roots = [parse_nbt_compressed(packed, lazy=True),
+                     parse_nbt_b64gz(base64.b64encode(packed), lazy=True),
+                     parse_nbt_file(path, lazy=True),
+                     Tape(self.data, lazy=True).materialize()]
+            roots += parse_many([self.data] * 3, threads=3, lazy=True)
+        for root in roots:
+            self.assertEqual(root["a"]["b"]["c"], 5)
+            self.assertEqual(root.to_dict(), self.expected)
+        self.assertEqual(extract(self.data, "a.b", lazy=True)["c"], 5)
+        with self.assertRaisesRegex(ValueError, "lazy"):
+            IncrementalParser(lazy=True)
+
+    def test_nameless_root(self):
+        options = {"nameless_root": True}
+        self.assertEqual(parse_nbt(self.nameless, **options), self.expected)
+        self.assertEqual(Tape(self.nameless, **options).materialize(),
+                         self.expected)
+        self.assertEqual(extract(self.nameless, "a.b.c", **options), 5)
+        self.assertEqual(validate(self.nameless, **options),
+                         len(self.nameless))
+        self.assertEqual(parse_many([self.nameless] * 3, threads=3, **options),
+                         [self.expected] * 3)
+        stream = IncrementalParser(**options)
+        self.assertEqual(stream.feed(self.nameless), [self.expected])
+
+    def test_unknown_keyword(self):
+        for call in (lambda: parse_nbt(self.data, array="list"),
+                     lambda: parse_many([self.data], threads=2, depth=4),
+                     lambda: Tape(self.data, little=True)):
+            with self.assertRaises(TypeError):
+                call()
+
+
+class B64GzTest(unittest.TestCase):
+    """Fused base64 + gzip decoding matches the Python pipeline."""
+
+    DOC = {"i": (9, (10, [{"id": (8, "stone"), "Count": (1, 64)},
+                          {"id": (8, "dirt"), "tag": (10, {"x": (3, -1)})}])),
+           "pad": (7, list(range(-50, 50)))}
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC)
+        self.expected = parse_nbt(self.data)
+
+    def test_str_and_bytes(self):
+        encoded = base64.b64encode(gzip.compress(self.data))
+        self.assertEqual(parse_nbt_b64gz(encoded), self.expected)
+        self.assertEqual(parse_nbt_b64gz(encoded.decode()), self.expected)
+        self.assertEqual(parse_nbt_b64gz(bytearray(encoded)), self.expected)
+
+    def test_unpadded_and_wrapped(self):
+        packed = gzip.compress(self.data)
+        for blob in (base64.b64encode(packed).rstrip(b"="),
+                     base64.encodebytes(packed),
+                     b"\t " + base64.b64encode(packed) + b"\r\n"):
+            self.assertEqual(parse_nbt_b64gz(blob), self.expected)
+
+    def test_concatenated_members(self):
+        half = len(self.data) // 2
+        packed = gzip.compress(self.data[:half]) + gzip.compress(
+            self.data[half:])
+        self.assertEqual(parse_nbt_b64gz(base64.b64encode(packed)),
+                         self.expected)
+
+    def test_invalid(self):
+        encoded = base64.b64encode(gzip.compress(self.data))
+        for blob in (encoded[:10] + b"*" + encoded[10:], encoded[:-1] + b"=A",
+                     encoded + b"A", b"", base64.b64encode(b"not gzip")):
+            with self.assertRaises(ValueError):
+                parse_nbt_b64gz(blob)
+
+    def test_example_data(self):
+        path = os.path.join(os.path.dirname(__file__), os.pardir,
+                            "example_data.txt")
+        if not os.path.exists(path):
+            self.skipTest("example_data.txt is not available")
+        with open(path) as f:
+            for line in f.read().split():
+                self.assertEqual(
+                    parse_nbt_b64gz(line),
+                    parse_nbt(gzip.decompress(base64.b64decode(line))))
+
+
+class ParseManyTest(unittest.TestCase):
+    """Threaded batches decode exactly like parse_nbt, in input order."""
+
+    def setUp(self):
+        writer = Writer()
+        self.buffers = [writer.root({
+            "id": (3, i),
+            "name": (8, "item%d" % i * (i % 7)),
+            "lists": (9, (9, [(4, list(range(i % 5))), (0, [])])),
+            "arrays": (10, {"i": (11, list(range(i))),
+                            "l": (12, [i] * (i % 3))}),
+        }) for i in range(40)]
+        self.expected = [parse_nbt(data) for data in self.buffers]
+
+    def test_matches_parse_nbt(self):
+        for threads in (0, 1, 2, 4, 64):
+            self.assertEqual(parse_many(self.buffers, threads=threads),
+                             self.expected, threads)
+
+    def test_buffer_types(self):
+        buffers = [kind(data) for data, kind in
+                   zip(self.buffers, [bytes, bytearray, memoryview] * 14)]
+        self.assertEqual(parse_many(tuple(buffers), threads=3), self.expected)
+
+    def test_options(self):
+        for arrays in ("list", "memoryview"):
+            self.assertEqual(
+                parse_many(self.buffers, threads=4, arrays=arrays),
+                [parse_nbt(data, arrays=arrays) for data in self.buffers])
+
+    def test_empty(self):
+        self.assertEqual(parse_many([], threads=4), [])
+
+    def test_first_error_wins(self):
+        buffers = list(self.buffers)
+        buffers[5] = buffers[5][:-4]
+        buffers[30] = b"\x01"
+        messages = set()
+        for threads in (1, 4):
+            with self.assertRaises(ValueError) as caught:
+                parse_many(buffers, threads=threads)
+            messages.add(str(caught.exception))
+        self.assertEqual(len(messages), 1)
+
+    def test_not_a_buffer(self):
+        with self.assertRaises(TypeError):
+            parse_many(self.buffers + ["text"], threads=2)
+        with self.assertRaises(TypeError):
+            parse_many(5)
+
+
+class TapeTest(unittest.TestCase):
+    """A tape indexes the document once and decodes any part of it."""
+
+    DOC = {
+        "inv": (9, (10, [{"id": (8, "stone"), "n": (1, 3)},
+                         {"id": (8, "dirt"), "tag": (10, {"d": (3, 9)})}])),
+        "pos": (9, (6, [1.5, -2.0, 3.25])),
+        "names": (9, (8, ["a", "bc"])),
+        "ints": (11, [10, 20, 30]),
+        "nested": (9, (9, [(3, [1, 2]), (8, ["x"])])),
+        "s": (8, "text"),
+    }
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC, name="root")
+        self.expected = parse_nbt(self.data)
+        self.tape = Tape(self.data)
+
+    def test_entries(self):
+        self.assertEqual(self.tape[0][0], 10)
+        self.assertEqual(self.tape[0][3], len(self.tape))
+        for i in range(len(self.tape)):
+            tag_type, offset, count, following = self.tape[i]
+            self.assertLess(offset, len(self.data))
+            self.assertGreater(following, i)
+            self.assertLessEqual(following, len(self.tape))
+        with self.assertRaises(IndexError):
+            self.tape[len(self.tape)]
+        self.assertIs(self.tape.data, self.data)
+
+    def test_materialize(self):
+        self.assertEqual(self.tape.materialize(), self.expected)
+        for key, value in self.expected.items():
+            self.assertEqual(self.tape.materialize(self.tape.find([key])),
+                             value)
+        with self.assertRaises(IndexError):
+            self.tape.materialize(len(self.tape))
+
+    def test_get(self):
+        tape = self.tape
+        self.assertEqual(tape.get([]), self.expected)
+        self.assertEqual(tape.get(["inv", 0, "id"]), "stone")
+        self.assertEqual(tape.get(["inv", -1, "tag", "d"]), 9)
+        self.assertEqual(tape.get(["pos", 2]), 3.25)
+        self.assertEqual(tape.get(["pos", -3]), 1.5)
+        self.assertEqual(tape.get(["names", 1]), "bc")
+        self.assertEqual(tape.get(["ints", -1]), 30)
+        self.assertEqual(tape.get(["nested", 1, 0]), "x")
+        self.assertEqual(tape.get(("inv", 1)), self.expected["inv"][1])
+
+    def test_get_missing(self):
+        for path in (["missing"], ["inv", 2], ["pos", -4], ["s", 0],
+                     ["ints", 0, 0], ["inv", 0, "id", "x"]):
+            self.assertIsNone(self.tape.get(path), path)
+            self.assertEqual(self.tape.get(path, "default"), "default")
+        with self.assertRaises(TypeError):
+            self.tape.get(["inv", 1.0])
+        with self.assertRaises(IndexError):
+            self.tape.find(["pos", 0])
+
+    def test_get_options(self):
+        tape = self.tape
+        self.assertEqual(tape.get(["ints"], arrays="memoryview").tolist(),
+                         [10, 20, 30])
+        root = tape.get(["inv", 1], lazy=True)
+        self.assertEqual(root["tag"]["d"], 9)
+        self.assertEqual(root.to_dict(), self.expected["inv"][1])
+
+    def test_invalid(self):
+        for data in (self.data[:-1], b"", b"\x0a\x00",
+                     self.data[:1] + b"\xff"):
+            with self.assertRaises(ValueError):
+                Tape(data)
+
+
+class TypedArrayTest(unittest.TestCase):
+    """Byte, int and long arrays decode to typed buffers in native order."""
+
+    ARRAYS = {"bytes": (7, [-128, 0, 127] * 11),
+              "ints": (11, [-(1 << 31), -1, 0, 1, (1 << 31) - 1] * 7),
+              "longs": (12, [-(1 << 63), -1, 0, (1 << 63) - 1] * 9),
+              "empty": (11, [])}
+
+    def setUp(self):
+        self.data = Writer().root(
+            dict(self.ARRAYS, list=(9, (10, [dict(self.ARRAYS)]))))
+
+    def check(self, root, convert):
+        for key, (tag_type, values) in self.ARRAYS.items():
+            self.assertEqual(convert(root[key]), values, key)
+            self.assertEqual(convert(root["list"][0][key]), values, key)
+
+    def test_memoryview(self):
+        root = parse_nbt(self.data, arrays="memoryview")
+        self.check(root, memoryview.tolist)
+        formats = {"bytes": "b", "ints": "i", "longs": "q"}
+        for key, fmt in formats.items():
+            self.assertEqual(root[key].format, fmt)
+            self.assertFalse(root[key].readonly)
+
+    def test_numpy(self):
+        try:
+            import numpy
+        except ImportError:
+            self.skipTest("numpy is not installed")
+        root = parse_nbt(self.data, arrays="numpy")
+        self.check(root, lambda array: array.tolist())
+        self.assertEqual(root["longs"].dtype, numpy.dtype("int64"))
+
+    def test_entry_points(self):
+        packed = gzip.compress(self.data)
+        for root in (parse_nbt_compressed(packed, arrays="memoryview"),
+                     parse_many([self.data] * 2, threads=2,
+                                arrays="memoryview")[1],
+                     Tape(self.data).materialize(arrays="memoryview"),
+                     Parser(arrays="memoryview").parse(self.data)):
+            self.check(root, memoryview.tolist)
+
+    def test_invalid_mode(self):
+        with self.assertRaisesRegex(ValueError, "arrays"):
+            parse_nbt(self.data, arrays="tuple")
+
+
+class ByteswapKernelTest(unittest.TestCase):
+    """Int and long arrays of every length and alignment decode the same
+    at each SIMD level."""
+
+    SCRIPT = """
+        import random
+        from nbt2dict import parse_nbt
+        from test_nbt2dict import Writer
+
+        rng = random.Random(5)
+        for endian in ("big", "little"):
+            writer = Writer(little_endian=endian == "little")
+            for n in list(range(80)) + [255, 256, 257, 1000]:
+                ints = [rng.randrange(-2**31, 2**31) for _ in range(n)]
+                longs = [rng.randrange(-2**63, 2**63) for _ in range(n)]
+                data = writer.root({"i": (11, ints), "l": (12, longs),
+                                    "li": (9, (3, ints)),
+                                    "ll": (9, (4, longs))}, name="x" * (n % 8))
+                for arrays in ("list", "memoryview"):
+                    root = parse_nbt(data, endian=endian, arrays=arrays)
+                    assert list(root["i"]) == ints, (endian, n, arrays)
+                    assert list(root["l"]) == longs, (endian, n, arrays)
+                    assert root["li"] == ints, (endian, n, arrays)
+                    assert root["ll"] == longs, (endian, n, arrays)
+    """
+
+    def test_levels(self):
+        run_at_simd_levels(self, self.SCRIPT)
+
+
+class SimdDispatchTest(unittest.TestCase):
+    """NBT2DICT_SIMD caps the level picked at import, and the base64
+    kernels agree with the base64 module at each level."""
+
+    SCRIPT = """
+        import base64, gzip, os, random
+        import nbt2dict
+        from nbt2dict import parse_nbt, parse_nbt_b64gz
+        from test_nbt2dict import SIMD_LEVELS, Writer
+
+        cap = os.environ["NBT2DICT_SIMD"]
+        assert SIMD_LEVELS.index(nbt2dict.simd) <= SIMD_LEVELS.index(cap)
+        assert cap != "scalar" or nbt2dict.simd == "scalar"
+
+        rng = random.Random(6)
+        for n in list(range(0, 160, 3)) + [1000, 4099]:
+            data = Writer().root({"b": (7, [rng.randrange(-128, 128)
+                                            for _ in range(n)])})
+            packed = gzip.compress(data)
+            encoded = base64.b64encode(packed)
+            expected = parse_nbt(data)
+            for blob in (encoded, encoded.rstrip(b"="),
+                         base64.encodebytes(packed),
+                         encoded[:n % 40] + b" " + encoded[n % 40:]):
+                assert parse_nbt_b64gz(blob) == expected, n
+            for at in (0, n % 37, len(encoded) // 2, len(encoded) - 5):
+                try:
+                    parse_nbt_b64gz(encoded[:at] + b"-" + encoded[at + 1:])
+                except ValueError:
+                    continue
+                raise AssertionError((n, at))
+    """
+
+    def test_level_names(self):
+        self.assertIn(nbt2dict.simd, SIMD_LEVELS)
+
+    def test_levels(self):
+        run_at_simd_levels(self, self.SCRIPT)
+
+
+class LazyCompoundTest(unittest.TestCase):
+    """Lazy compounds behave like read-only dicts of the decoded values."""
+
+    DOC = {
+        "b": (1, -5), "s": (8, "str"), "f": (6, 0.25),
+        "list": (9, (10, [{"x": (3, 1)}, {"y": (10, {"z": (2, 2)})}])),
+        "ints": (9, (3, [1, 2, 3])),
+        "sub": (10, {"k": (4, 1 << 40), "empty": (10, {})}),
+    }
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC)
+        self.expected = parse_nbt(self.data)
+        self.root = parse_nbt(self.data, lazy=True)
+
+    def test_mapping(self):
+        root = self.root
+        self.assertIsInstance(root, collections.abc.Mapping)
+        self.assertEqual(len(root), len(self.expected))
+        self.assertEqual(list(root), list(self.expected))
+        self.assertEqual(root.keys(), list(self.expected))
+        self.assertEqual(dict(root.items())["b"], -5)
+        self.assertEqual(len(root.values()), len(self.expected))
+        self.assertIn("sub", root)
+        self.assertNotIn("missing", root)
+        self.assertNotIn(1, root)
+        self.assertEqual(root.get("missing"), None)
+        self.assertEqual(root.get("missing", 0), 0)
+        self.assertEqual(root.get(1, 0), 0)
+        with self.assertRaises(KeyError):
+            root["missing"]
+        with self.assertRaises(KeyError):
+            root[b"b"]
+        with self.assertRaises(TypeError):
+            root["b"] = 1
+        self.assertIn("6 keys", repr(root))
+
+    def test_values(self):
+        root = self.root
+        self.assertEqual(root["s"], "str")
+        self.assertEqual(root["ints"], [1, 2, 3])
+        self.assertEqual(root["list"][1]["y"]["z"], 2)
+        self.assertEqual(len(root["sub"]["empty"]), 0)
+        self.assertIs(root["sub"], root["sub"])
+        self.assertIs(root.get("list"), root["list"])
+
+    def test_equality(self):
+        self.assertEqual(self.root, self.expected)
+        self.assertEqual(self.expected, self.root)
+        self.assertNotEqual(self.root, dict(self.expected, b=0))
+        self.assertNotEqual(self.root, [])
+        self.assertEqual(dict(self.root["sub"]), self.expected["sub"])
+
+    def test_to_dict(self):
+        result = self.root.to_dict()
+        self.assertIs(type(result), dict)
+        self.assertIs(type(result["list"][0]), dict)
+        self.assertEqual(result, self.expected)
+        self.assertEqual(self.root["list"][0].to_dict(), {"x": 1})
+
+    def test_outlives_source(self):
+        data = bytearray(self.data)
+        root = parse_nbt(data, lazy=True)
+        del data
+        gc.collect()
+        self.assertEqual(root.to_dict(), self.expected)
+
+
+class ExtractTest(unittest.TestCase):
+    """Path grammar: keys split on '.', [] maps over a list, [n] indexes
+    it from either end, anything missing is None."""
+
+    DOC = {
+        "i": (9, (10, [
+            {"id": (8, "stone"), "Count": (1, 64),
+             "tag": (10, {"ExtraAttributes": (10, {"id": (8, "A")})})},
+            {"id": (8, "dirt"), "Count": (1, 1)},
+            {"id": (8, "sand"), "Count": (1, 2),
+             "tag": (10, {"ExtraAttributes": (10, {"id": (8, "C")})})},
+        ])),
+        "grid": (9, (9, [(3, [1, 2]), (3, []), (3, [5])])),
+        "longs": (12, [7, 8, 9]),
+        "pos": (9, (6, [0.5, 1.5])),
+        "empty": (9, (0, [])),
+        "s": (8, "x"),
+    }
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC)
+        self.expected = parse_nbt(self.data)
+
+    def check(self, path, value):
+        self.assertEqual(extract(self.data, path), value, path)
+
+    def test_keys(self):
+        self.check("", self.expected)
+        self.check("s", "x")
+        self.check("i", self.expected["i"])
+        self.check("missing", None)
+        self.check("s.deeper", None)
+        self.check("i.id", None)
+
+    def test_each(self):
+        self.check("i[].id", ["stone", "dirt", "sand"])
+        self.check("i[].tag.ExtraAttributes.id", ["A", None, "C"])
+        self.check("grid[][0]", [1, None, 5])
+        self.check("grid[][]", [[1, 2], [], [5]])
+        self.check("longs[]", [7, 8, 9])
+        self.check("empty[]", [])
+        self.check("s[]", None)
+
+    def test_index(self):
+        self.check("i[0].Count", 64)
+        self.check("i[-1].id", "sand")
+        self.check("i[-3].id", "stone")
+        self.check("i[3]", None)
+        self.check("i[-4]", None)
+        self.check("grid[0][1]", 2)
+        self.check("grid[-1][-1]", 5)
+        self.check("longs[-1]", 9)
+        self.check("pos[1]", 1.5)
+        self.check("s[0]", None)
+
+    def test_many(self):
+        paths = ["i[].Count", "pos[0]", "missing"]
+        self.assertEqual(extract(self.data, paths),
+                         [[64, 1, 2], 0.5, None])
+        self.assertEqual(extract(self.data, tuple(paths)),
+                         extract(self.data, paths))
+        self.assertEqual(extract(self.data, []), [])
+
+    def test_invalid_paths(self):
+        for path in ("i[", "i[0", "i[x]", "i[0]x", "i[1.5]", "i[0]]",
+                     "[]]"):
+            with self.assertRaisesRegex(ValueError, "Invalid path", msg=path):
+                extract(self.data, path)
+        for paths in (5, [b"i"], ["s", 1]):
+            with self.assertRaises(TypeError):
+                extract(self.data, paths)
+
+    def test_invalid_data(self):
+        with self.assertRaises(ValueError):
+            extract(self.data[:len(self.data) // 2], "s")
+
+
+class ValidateTest(unittest.TestCase):
+    """The skip engine accepts what the decoder accepts and measures it."""
+
+    DOC = {
+        "bytes": (7, [1, 2, 3]), "ints": (11, [1]), "longs": (12, [2, 3]),
+        "doubles": (9, (6, [1.0, 2.0])), "shorts": (9, (2, [1, 2, 3])),
+        "strings": (9, (8, ["a", "é"])),
+        "lists": (9, (9, [(1, [1]), (10, [{"k": (3, 1)}])])),
+        "sub": (10, {"s": (8, "v"), "e": (9, (0, []))}),
+    }
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC, name="root")
+
+    def test_length(self):
+        self.assertEqual(validate(self.data), len(self.data))
+        self.assertEqual(validate(self.data + b"trailing"), len(self.data))
+        self.assertEqual(validate(memoryview(self.data)), len(self.data))
+
+    def test_truncated(self):
+        for size in range(len(self.data)):
+            with self.assertRaises(ValueError, msg=size):
+                validate(self.data[:size])
+
+    def test_invalid(self):
+        writer = Writer()
+        for data in (b"\x0d\x00\x00",
+                     b"\x0a\x00\x00\x0d\x00\x01a\x00",
+                     b"\x0a\x00\x00\x0b\x00\x01a" + writer.pack("i", -1) +
+                     b"\x00",
+                     b"\x0a\x00\x00\x09\x00\x01a\x03" + writer.pack("i", -2) +
+                     b"\x00",
+                     b"\x0a\x00\x00\x09\x00\x01a\x0d" + writer.pack("i", 1) +
+                     b"\x00"):
+            with self.assertRaises(ValueError, msg=data):
+                validate(data)
+            with self.assertRaises(ValueError, msg=data):
+                parse_nbt(data)
+
+    def test_agrees_with_parse(self):
+        data = bytearray(self.data)
+        for i in range(len(data)):
+            for value in (0x00, 0x7F, 0xFF):
+                mutated = bytes(data[:i]) + bytes([value]) + bytes(
+                    data[i + 1:])
+                try:
+                    parse_nbt(mutated)
+                except ValueError:
+                    continue
+                self.assertGreater(validate(mutated), 0, (i, value))
+
+
+class KeyCacheTest(unittest.TestCase):
+    """Compound keys are decoded once per cache and shared afterwards."""
+
+    def test_hits(self):
+        keys = ["id", "Count", "tag", "x" * 64, "été"]
+        data = Writer().root({key: (1, i) for i, key in enumerate(keys)})
+        parser = Parser()
+        first = parser.parse(data)
+        self.assertEqual(parser.stats["key_misses"], len(keys))
+        self.assertEqual(parser.stats["key_hits"], 0)
+        second = parser.parse(data)
+        # later keys are matched through the root's cached shape
+        self.assertEqual(parser.stats["key_misses"], len(keys))
+        self.assertEqual(parser.stats["key_hits"], 1)
+        for a, b in zip(first, second):
+            self.assertIs(a, b)
+        parser.clear()
+        self.assertEqual(parser.stats["key_hits"], 0)
+        self.assertEqual(parser.stats["key_misses"], 0)
+
+    def test_long_keys_bypass(self):
+        long_key = "k" * 65
+        data = Writer().root({long_key: (1, 1)})
+        parser = Parser()
+        self.assertEqual(parser.parse(data), {long_key: 1})
+        self.assertEqual(parser.parse(data), {long_key: 1})
+        self.assertEqual(parser.stats["key_hits"] + parser.stats["key_misses"],
+                         0)
+
+    def test_collisions(self):
+        keys = ["key%d" % i for i in range(3000)] + ["a", "a\x00", "a" * 8,
+                                                       "a" * 9, ""]
+        doc = {key: (3, i) for i, key in enumerate(keys)}
+        data = Writer().root(doc)
+        parser = Parser()
+        for _ in range(2):
+            self.assertEqual(parser.parse(data),
+                             {key: i for i, key in enumerate(keys)})
+            self.assertEqual(parse_nbt(data),
+                             {key: i for i, key in enumerate(keys)})
+
+
+class ShapeCacheTest(unittest.TestCase):
+    """Cached key layouts only ever speed up matching compounds."""
+
+    def plain(self, tag_type, value):
+        if tag_type == 9:
+            elem_type, items = value
+            return [self.plain(elem_type, item) for item in items]
+        if tag_type == 10:
+            return {key: self.plain(*child) for key, child in value.items()}
+        return list(value) if tag_type in (7, 11, 12) else value
+
+    def check(self, compounds):
+        doc = {"list": (9, (10, compounds))}
+        data = Writer().root(doc)
+        parser = Parser()
+        for _ in range(2):
+            # repr() also compares the key order
+            self.assertEqual(repr(parser.parse(data)),
+                             repr(self.plain(10, doc)))
+        return parser.stats
+
+    def test_repeated_layout(self):
+        stats = self.check([{"id": (8, "item%d" % i), "n": (1, i),
+                             "tag": (10, {"d": (3, i)})} for i in range(100)])
+        self.assertGreater(stats["shape_hits"], stats["shape_misses"])
+
+    def test_diverging_layouts(self):
+        self.check([
+            {"id": (8, "a"), "n": (1, 1), "x": (3, 2)},
+            {"id": (8, "b"), "n": (1, 1)},
+            {"id": (8, "c"), "x": (3, 2), "n": (1, 1)},
+            {"id": (8, "d"), "n": (1, 1), "x": (3, 2), "y": (3, 3)},
+            {"id": (8, "e")},
+            {"id": (3, 5), "n": (8, "typed differently")},
+            {"n": (1, 1), "id": (8, "f")},
+            {"id": (8, "g"), "n": (1, 1), "x": (3, 2)},
+        ])
+
+    def test_wide_compounds(self):
+        wide = {"k%02d" % i: (3, i) for i in range(40)}
+        narrow = dict(list(wide.items())[:32])
+        self.check([wide, narrow, wide, dict(wide, extra=(1, 1))])
+
+    def test_duplicate_keys(self):
+        writer = Writer()
+        data = (b"\x0a" + writer.name("") + b"\x01" + writer.name("a") +
+                b"\x01\x01" + writer.name("a") + b"\x02\x00")
+        parser = Parser()
+        for _ in range(2):
+            self.assertEqual(parser.parse(data), {"a": 2})
+
+
+class ParserTest(unittest.TestCase):
+    """A Parser decodes like the module functions with its own options."""
+
+    DOC = {"i": (9, (10, [{"id": (8, "stone"), "a": (11, [1, 2])}] * 3)),
+           "s": (8, "x")}
+
+    def setUp(self):
+        self.data = Writer().root(self.DOC)
+        self.expected = parse_nbt(self.data)
+
+    def test_methods(self):
+        packed = gzip.compress(self.data)
+        parser = Parser()
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "level.dat")
+            with open(path, "wb") as f:
+                f.write(packed)
+            for _ in range(2):
+                self.assertEqual(parser.parse(self.data), self.expected)
+                self.assertEqual(parser.parse_b64gz(base64.b64encode(packed)),
+                                 self.expected)
+                self.assertEqual(parser.parse_compressed(packed),
+                                 self.expected)
+                self.assertEqual(parser.parse_file(path), self.expected)
+        self.assertEqual(parser.stats["calls"], 8)
+        before = parser.stats["bytes"]
+        parser.parse(self.data)
+        self.assertEqual(parser.stats["bytes"] - before, len(self.data))
+
+    def test_options(self):
+        parser = Parser(arrays="memoryview", lazy=True)
+        for root in (parser.parse(self.data),
+                     parser.parse_compressed(zlib.compress(self.data))):
+            self.assertEqual(root["i"][2]["a"].tolist(), [1, 2])
+            self.assertEqual(root["s"], "x")
+        data = Writer(little_endian=True).root(self.DOC)
+        self.assertEqual(Parser(endian="little").parse(data), self.expected)
+
+    def test_independent_caches(self):
+        first, second = Parser(), Parser()
+        first.parse(self.data)
+        self.assertEqual(second.stats["calls"], 0)
+        self.assertEqual(second.stats["key_hits"], 0)
+        first.clear()
+        self.assertEqual(first.stats["calls"], 0)
+        self.assertEqual(first.parse(self.data), self.expected)
+
+    def test_errors(self):
+        parser = Parser()
+        with self.assertRaises(TypeError):
+            Parser("list")
+        with self.assertRaises(ValueError):
+            parser.parse(self.data[:-1])
+        with self.assertRaises(ValueError):
+            parser.parse_compressed(self.data)
+        with self.assertRaises(ValueError):
+            parser.parse_b64gz("!!")
+        with self.assertRaises(OSError):
+            parser.parse_file(os.path.join(tempfile.gettempdir(),
+                                           "missing", "level.dat"))
+        self.assertEqual(parser.parse(self.data), self.expected)
+
+
+class ArgumentTest(unittest.TestCase):
+    """Fast-call argument parsing mirrors Python's own binding rules."""
+
+    def setUp(self):
+        self.data = Writer().root({"a": (3, 1)})
+
+    def test_binding(self):
+        self.assertEqual(parse_nbt(data=self.data), {"a": 1})
+        self.assertEqual(parse_many(buffers=[self.data], threads=1),
+                         [{"a": 1}])
+        self.assertEqual(parse_many([self.data], 2), [{"a": 1}])
+        self.assertEqual(extract(self.data, "a"), 1)
+        self.assertEqual(extract(paths="a", data=self.data), 1)
+        self.assertEqual(validate(data=self.data), len(self.data))
+
+    def test_errors(self):
+        for call in (lambda: parse_nbt(),
+                     lambda: parse_nbt(self.data, self.data),
+                     lambda: parse_nbt(self.data, data=self.data),
+                     lambda: parse_nbt(self.data, "list"),
+                     lambda: parse_nbt(self.data, bogus=1),
+                     lambda: parse_many([self.data], 1, "list"),
+                     lambda: extract(self.data),
+                     lambda: extract(self.data, "a", "b"),
+                     lambda: validate(self.data, 512),
+                     lambda: parse_nbt_file()):
+            with self.assertRaises(TypeError):
+                call()
+
+    def test_option_types(self):
+        for call in (lambda: parse_nbt(self.data, max_depth="1"),
+                     lambda: parse_nbt(self.data, arrays=1),
+                     lambda: parse_nbt(self.data, endian=None),
+                     lambda: parse_many([self.data], threads="2")):
+            with self.assertRaises(TypeError):
+                call()
+        with self.assertRaises(ValueError):
+            parse_nbt(self.data, endian="middle")
+        self.assertEqual(parse_nbt(self.data, lazy=1, varint=0).to_dict(),
+                         {"a": 1})
+
+
+class MaxDepthTest(unittest.TestCase):
+    """Nesting is bounded by max_depth, not by the C stack, everywhere."""
+
+    @staticmethod
+    def compounds(levels):
+        return b"\x0a\x00\x00" + b"\x0a\x00\x01a" * levels + b"\x00" * (
+            levels + 1)
+
+    @staticmethod
+    def lists(levels):
+        return (b"\x0a\x00\x00\x09\x00\x01a" + b"\x09\x00\x00\x00\x01" *
+                (levels - 1) + b"\x00\x00\x00\x00\x00\x00")
+
+    def entry_points(self, data, max_depth):
+        return [
+            lambda: parse_nbt(data, max_depth=max_depth),
+            lambda: parse_nbt(data, max_depth=max_depth, lazy=True).to_dict(),
+            lambda: Tape(data, max_depth=max_depth).materialize(),
+            lambda: validate(data, max_depth=max_depth),
+            lambda: extract(data, "", max_depth=max_depth),
+            lambda: IncrementalParser(max_depth=max_depth).feed(data),
+            lambda: parse_many([data] * 2, threads=2, max_depth=max_depth),
+        ]
+
+    def test_limit(self):
+        for build in (self.compounds, self.lists):
+            for levels in (1, 5, 40):
+                for call in self.entry_points(build(levels), levels):
+                    call()
+                for call in self.entry_points(build(levels), levels - 1):
+                    with self.assertRaisesRegex(ValueError, "depth"):
+                        call()
+
+    def test_default(self):
+        parse_nbt(self.compounds(512))
+        with self.assertRaisesRegex(ValueError, "depth"):
+            parse_nbt(self.compounds(513))
+
+    def test_deep(self):
+        levels = 100000
+        root = parse_nbt(self.compounds(levels), max_depth=levels)
+        for _ in range(levels):
+            root = root["a"]
+        self.assertEqual(root, {})
+        self.assertEqual(validate(self.lists(levels), max_depth=levels),
+                         len(self.lists(levels)))
+
+
+class BoundsTest(unittest.TestCase):
+    """Truncated or oversized input fails cleanly before anything is read
+    past the end or allocated for it."""
+
+    DOC = {"ints": (11, [1, 2, 3]), "longs": (12, [4]), "bytes": (7, [5]),
+           "shorts": (9, (2, [1, 2])), "s": (8, "text"),
+           "items": (9, (10, [{"id": (8, "a")}, {"id": (8, "b")}])),
+           "names": (9, (8, ["x", "yz"]))}
+
+    def test_truncated(self):
+        for little_endian in (False, True):
+            endian = "little" if little_endian else "big"
+            data = Writer(little_endian=little_endian).root(self.DOC)
+            for size in range(len(data)):
+                for arrays in ("list", "memoryview"):
+                    with self.assertRaisesRegex(ValueError, "end of data"):
+                        parse_nbt(data[:size], endian=endian, arrays=arrays)
+
+    def test_oversized_lengths(self):
+        huge = struct.pack(">i", 2**31 - 1)
+        for payload in (b"\x0b" + b"\x00\x01a" + huge,
+                        b"\x07" + b"\x00\x01a" + huge,
+                        b"\x08" + b"\x00\x01a" + b"\xff\xff",
+                        b"\x09" + b"\x00\x01a" + b"\x03" + huge,
+                        b"\x09" + b"\x00\x01a" + b"\x08" + huge,
+                        b"\x09" + b"\x00\x01a" + b"\x09" + huge,
+                        b"\x09" + b"\x00\x01a" + b"\x0a" + huge):
+            data = b"\x0a\x00\x00" + payload + b"\x00" * 16
+            for arrays in ("list", "memoryview"):
+                with self.assertRaisesRegex(ValueError, "end of data"):
+                    parse_nbt(data, arrays=arrays)
+            with self.assertRaisesRegex(ValueError, "end of data"):
+                Tape(data)
+
+
+def uvarint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append(value & 0x7F | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+class VarintWriter(Writer):
+    """Bedrock network NBT: zigzag varint ints, longs and lengths."""
+
+    def __init__(self):
+        super().__init__(little_endian=True, encode=str.encode)
+
+    def zigzag(self, value, bits):
+        mask = (1 << bits) - 1
+        return uvarint(((value << 1) ^ (value >> (bits - 1))) & mask)
+
+    def name(self, text):
+        data = self.encode(text)
+        return uvarint(len(data)) + data
+
+    def payload(self, tag_type, value):
+        if tag_type in (3, 4):
+            return self.zigzag(value, 32 if tag_type == 3 else 64)
+        if tag_type in (7, 11, 12):
+            items = (self.pack("%db" % len(value), *value) if tag_type == 7
+                     else b"".join(self.payload(tag_type - 8, item)
+                                   for item in value))
+            return self.zigzag(len(value), 32) + items
+        if tag_type == 9:
+            elem_type, items = value
+            return bytes([elem_type]) + self.zigzag(len(items), 32) + b"".join(
+                self.payload(elem_type, item) for item in items)
+        return super().payload(tag_type, value)
+
+
+class VarintTest(unittest.TestCase):
+    """varint=True decodes zigzag varints at every width and position."""
+
+    INTS = [0, 1, -1, 63, -64, 64, -65, 8191, -8192, 1 << 20, -(1 << 27),
+            2**31 - 1, -2**31]
+    LONGS = INTS + [1 << 35, -(1 << 49), 1 << 56, 2**63 - 1, -2**63]
+
+    def check(self, doc):
+        data = VarintWriter().root(doc)
+        expected = parse_nbt(Writer().root(doc))
+        self.assertEqual(parse_nbt(data, varint=True), expected)
+        self.assertEqual(parse_many([data] * 3, threads=3, varint=True),
+                         [expected] * 3)
+        stream = IncrementalParser(varint=True)
+        self.assertEqual([root for i in range(len(data))
+                          for root in stream.feed(data[i:i + 1])], [expected])
+        return data
+
+    def test_scalars(self):
+        for value in self.INTS:
+            self.check({"i": (3, value)})
+        for value in self.LONGS:
+            self.check({"l": (4, value), "after": (1, 1)})
+            self.check({"l": (4, value)})
+
+    def test_containers(self):
+        self.check({
+            "name": (8, "x" * 200),
+            "ints": (11, self.INTS), "longs": (12, self.LONGS),
+            "bytes": (7, [-1, 2]), "short": (2, -2), "d": (6, 0.5),
+            "li": (9, (3, self.INTS)), "ll": (9, (4, self.LONGS)),
+            "items": (9, (10, [{"id": (8, "a")}] * 130)),
+            "empty": (9, (0, [])),
+        })
+
+    def test_typed_arrays(self):
+        data = VarintWriter().root({"ints": (11, self.INTS),
+                                    "longs": (12, self.LONGS)})
+        root = parse_nbt(data, varint=True, arrays="memoryview")
+        self.assertEqual(root["ints"].tolist(), self.INTS)
+        self.assertEqual(root["longs"].tolist(), self.LONGS)
+
+    def test_invalid(self):
+        root = b"\x0a\x00"
+        with self.assertRaisesRegex(ValueError, "Invalid varint"):
+            parse_nbt(root + b"\x03\x01a" + b"\xff" * 5 + b"\x01\x00" * 8,
+                      varint=True)
+        with self.assertRaisesRegex(ValueError, "Invalid varint"):
+            parse_nbt(root + b"\x04\x01a" + b"\xff" * 10 + b"\x01\x00" * 8,
+                      varint=True)
+        with self.assertRaisesRegex(ValueError, "end of data"):
+            parse_nbt(root + b"\x04\x01a\xff\xff", varint=True)
+        with self.assertRaisesRegex(ValueError, "list length"):
+            parse_nbt(root + b"\x09\x01a\x03\x01\x00", varint=True)
+        with self.assertRaisesRegex(ValueError, "lazy"):
+            parse_nbt(root + b"\x00", varint=True, lazy=True)
+
+
+class NamelessRootTest(unittest.TestCase):
+    """nameless_root=True reads a root tag with no name, in place."""
+
+    DOC = {"text": (8, "hello"), "n": (3, 7),
+           "extra": (9, (10, [{"a": (1, 1)}]))}
+
+    def setUp(self):
+        self.named = Writer().root(self.DOC, name="ignored")
+        self.nameless = b"\x0a" + Writer().payload(10, self.DOC)
+        self.expected = parse_nbt(self.named)
+
+    def test_offset_view(self):
+        packet = b"\x01\x02\x03" + self.nameless + b"trailing"
+        view = memoryview(packet)[3:]
+        self.assertEqual(parse_nbt(view, nameless_root=True), self.expected)
+        root = parse_nbt(view, nameless_root=True, lazy=True)
+        self.assertEqual(root.to_dict(), self.expected)
+        self.assertEqual(validate(view, nameless_root=True),
+                         len(self.nameless))
+
+    def test_encodings(self):
+        little = b"\x0a" + Writer(little_endian=True).payload(10, self.DOC)
+        self.assertEqual(parse_nbt(little, endian="little",
+                                   nameless_root=True), self.expected)
+        network = b"\x0a" + VarintWriter().payload(10, self.DOC)
+        self.assertEqual(parse_nbt(network, varint=True, nameless_root=True),
+                         self.expected)
+
+    def test_compressed(self):
+        packed = gzip.compress(self.nameless)
+        self.assertEqual(parse_nbt_compressed(packed, nameless_root=True),
+                         self.expected)
+        self.assertEqual(parse_nbt_b64gz(base64.b64encode(packed),
+                                         nameless_root=True), self.expected)
+        self.assertEqual(Parser(nameless_root=True).parse_compressed(packed),
+                         self.expected)
+
+    def test_scalar_roots(self):
+        self.assertEqual(parse_nbt(b"\x08\x00\x02hi", nameless_root=True),
+                         "hi")
+        self.assertEqual(parse_nbt(b"\x03\x00\x00\x00\x05",
+                                   nameless_root=True), 5)
+        self.assertIsNone(parse_nbt(b"\x00", nameless_root=True))
+
+
+class AsciiKernelTest(unittest.TestCase):
+    """Strings and keys decode the same at each SIMD level whether or not,
+    and wherever, they leave ASCII."""
+
+    SCRIPT = """
+        import random
+        from nbt2dict import parse_nbt
+        from test_nbt2dict import Writer
+
+        rng = random.Random(19)
+        writer = Writer()
+        for n in list(range(1, 140)) + [1000, 4097]:
+            ascii = "".join(chr(rng.randrange(1, 128)) for _ in range(n))
+            texts = [ascii]
+            for at in sorted({0, n // 2, n - 1, n % 33}):
+                for char in ("\\x00", "\\xe9", "\\u4e2d", "\\U0001F600"):
+                    texts.append(ascii[:at] + char + ascii[at + 1:])
+            for text in texts:
+                data = writer.root({text: (8, text), "s": (8, text)})
+                assert parse_nbt(data) == {text: text, "s": text}, (n, text)
+    """
+
+    def test_levels(self):
+        run_at_simd_levels(self, self.SCRIPT)
+
+
+class FileTest(unittest.TestCase):
+    """Files decode like their contents, read or mapped, compressed or not."""
+
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.addCleanup(self.directory.cleanup)
+        writer = Writer()
+        self.small = writer.root({"s": (8, "small")})
+        self.large = writer.root({"a": (12, list(range(20000))),
+                                  "s": (8, "large")})
+
+    def write(self, name, data):
+        path = os.path.join(self.directory.name, name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def test_formats(self):
+        for data in (self.small, self.large):
+            expected = parse_nbt(data)
+            for name, packed in (("raw", data), ("gz", gzip.compress(data)),
+                                 ("zlib", zlib.compress(data))):
+                path = self.write("%d.%s" % (len(data), name), packed)
+                self.assertEqual(parse_nbt_file(path), expected)
+                self.assertEqual(parse_nbt_file(pathlib.Path(path)), expected)
+                self.assertEqual(parse_nbt_file(os.fsencode(path)), expected)
+                self.assertEqual(Parser().parse_file(path), expected)
+                root = parse_nbt_file(path, lazy=True)
+                os.remove(path)
+                self.assertEqual(root.to_dict(), expected)
+
+    def test_errors(self):
+        with self.assertRaises(FileNotFoundError):
+            parse_nbt_file(os.path.join(self.directory.name, "missing.dat"))
+        with self.assertRaises(OSError):
+            parse_nbt_file(self.directory.name)
+        with self.assertRaises(ValueError):
+            parse_nbt_file(self.write("empty.dat", b""))
+        with self.assertRaises(ValueError):
+            parse_nbt_file(self.write("cut.dat", self.large[:-10]))
+        with self.assertRaises(TypeError):
+            parse_nbt_file(5)
+
+
+def region_file(chunks):
+    """Builds an .mca file from {(x, z): (compression, payload)}; chunk
+    (x, z) gets the timestamp 1000 + x + 32 * z."""
+    header = bytearray(2 * 4096)
+    body = bytearray()
+    for (x, z), (compression, payload) in chunks.items():
+        index = x + z * 32
+        record = struct.pack(">iB", len(payload) + 1, compression) + payload
+        sectors = -(-len(record) // 4096)
+        location = (2 + len(body) // 4096) << 8 | sectors
+        header[index * 4:index * 4 + 4] = struct.pack(">I", location)
+        header[4096 + index * 4:4100 + index * 4] = struct.pack(
+            ">I", 1000 + index)
+        body += record.ljust(sectors * 4096, b"\0")
+    return bytes(header + body)
+
+
+class RegionFileTest(unittest.TestCase):
+    """Chunks are located and decoded on demand, one error per chunk."""
+
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.addCleanup(self.directory.cleanup)
+        writer = Writer()
+        self.docs = {(x, z): writer.root({
+            "xPos": (3, x), "zPos": (3, z),
+            "sections": (9, (10, [{"data": (12, list(range(x * 50 + z)))}])),
+        }) for x, z in ((0, 0), (1, 0), (31, 0), (5, 7), (0, 31))}
+        self.path = self.write("r.0.0.mca", region_file({
+            (0, 0): (1, gzip.compress(self.docs[0, 0])),
+            (1, 0): (2, zlib.compress(self.docs[1, 0])),
+            (31, 0): (3, self.docs[31, 0]),
+            (5, 7): (2, zlib.compress(self.docs[5, 7], 9)),
+            (0, 31): (1, gzip.compress(self.docs[0, 31])),
+        }))
+
+    def write(self, name, data):
+        path = os.path.join(self.directory.name, name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def test_chunks(self):
+        with RegionFile(self.path) as region:
+            self.assertEqual(region.path, self.path)
+            self.assertEqual(region.chunks(),
+                             [(0, 0), (1, 0), (31, 0), (5, 7), (0, 31)])
+            for (x, z), data in self.docs.items():
+                self.assertEqual(region.chunk(x, z), parse_nbt(data))
+                self.assertEqual(region.chunk(x + 32, z - 64),
+                                 parse_nbt(data))
+                self.assertEqual(region.timestamp(x, z), 1000 + x + 32 * z)
+            self.assertIsNone(region.chunk(2, 2))
+            self.assertEqual(region.timestamp(2, 2), 0)
+
+    def test_options(self):
+        with RegionFile(self.path, arrays="memoryview", lazy=True) as region:
+            for (x, z), data in self.docs.items():
+                chunk = region.chunk(x, z)
+                self.assertEqual(chunk["xPos"], x)
+                self.assertEqual(chunk["sections"][0]["data"].tolist(),
+                                 list(range(x * 50 + z)))
+
+    def test_corrupt_chunks(self):
+        data = bytearray(region_file({
+            (0, 0): (1, gzip.compress(self.docs[0, 0])),
+            (1, 0): (4, b"lz4"),
+            (2, 0): (0x82, b""),
+            (3, 0): (9, b"x"),
+            (4, 0): (1, b"not gzip"),
+            (5, 0): (2, zlib.compress(self.docs[0, 0])[:-8]),
+        }))
+        # (6, 0) points past the end, (7, 0) shares (0, 0)'s sectors and
+        # (8, 0) claims more bytes than its sector holds
+        data[6 * 4:7 * 4] = struct.pack(">I", 500 << 8 | 1)
+        data[7 * 4:8 * 4] = data[0:4]
+        data[8 * 4:9 * 4] = struct.pack(">I", (len(data) // 4096) << 8 | 1)
+        data += struct.pack(">i", 1 << 20) + b"\x01" + b"\0" * 4091
+        errors = {(1, 0): "LZ4", (2, 0): "external", (3, 0): "unknown",
+                  (4, 0): "", (5, 0): "", (6, 0): "outside",
+                  (8, 0): "invalid length"}
+        with RegionFile(self.write("corrupt.mca", bytes(data))) as region:
+            self.assertEqual(region.chunk(7, 0), parse_nbt(self.docs[0, 0]))
+            for (x, z), message in errors.items():
+                with self.assertRaisesRegex(ValueError, message):
+                    region.chunk(x, z)
+            self.assertEqual(region.chunk(0, 0), parse_nbt(self.docs[0, 0]))
+
+    def test_file_errors(self):
+        with self.assertRaisesRegex(ValueError, "truncated"):
+            RegionFile(self.write("short.mca", b"\0" * 100))
+        with self.assertRaises(FileNotFoundError):
+            RegionFile(os.path.join(self.directory.name, "missing.mca"))
+        with RegionFile(self.write("empty.mca", b"")) as region:
+            self.assertEqual(region.chunks(), [])
+            self.assertIsNone(region.chunk(0, 0))
+        region = RegionFile(self.path)
+        region.close()
+        with self.assertRaisesRegex(ValueError, "closed"):
+            region.chunk(0, 0)
+        with self.assertRaisesRegex(ValueError, "closed"):
+            region.chunks()
+
+
+class RegionPoolTest(unittest.TestCase):
+    """Whole regions and worlds decode like RegionFile, chunk by chunk."""
+
+    COMPRESS = {1: gzip.compress, 2: zlib.compress, 3: bytes}
+
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.addCleanup(self.directory.cleanup)
+        self.world = os.path.join(self.directory.name, "world")
+        writer = Writer()
+        self.docs = {}
+        chunks = {}
+        for i in range(32):
+            x, z = i * 7 % 32, i * 13 % 32
+            self.docs[x, z] = writer.root({
+                "xPos": (3, x), "zPos": (3, z),
+                "heights": (12, list(range(i * 10))),
+                "entities": (9, (10, [{"id": (8, "e%d" % j)}
+                                      for j in range(i % 4)])),
+            })
+            compression = i % 3 + 1
+            chunks[x, z] = (compression,
+                            self.COMPRESS[compression](self.docs[x, z]))
+        self.expected = [(x, z, parse_nbt(self.docs[x, z]))
+                         for x, z in sorted(self.docs, key=lambda c: c[::-1])]
+        self.path = self.write("region/r.0.0.mca", region_file(chunks))
+
+    def write(self, name, data):
+        path = os.path.join(self.world, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def test_parse_region(self):
+        for threads in (0, 1, 3, 100):
+            self.assertEqual(parse_region(self.path, threads=threads),
+                             self.expected, threads)
+        with RegionFile(self.path) as region:
+            self.assertEqual([(x, z, region.chunk(x, z))
+                              for x, z in region.chunks()], self.expected)
+
+    def test_iter_region(self):
+        for threads in (1, 4):
+            chunks = sorted(iter_region(self.path, threads=threads),
+                            key=lambda item: item[1::-1])
+            self.assertEqual(chunks, self.expected)
+
+    def test_iter_world(self):
+        other = self.write("DIM-1/region/r.-1.0.mca", region_file({
+            (3, 4): (2, zlib.compress(self.docs[0, 0]))}))
+        self.write("region/notes.txt", b"not a region")
+        self.write("region/r.1.0.mca", b"")
+        items = list(iter_world(self.world, threads=3))
+        self.assertEqual(sorted({item[0] for item in items}),
+                         sorted([self.path, other]))
+        self.assertEqual(
+            sorted(item[1:] for item in items if item[0] == self.path),
+            sorted(self.expected, key=lambda item: item[:2]))
+        self.assertIn((other, 3, 4, parse_nbt(self.docs[0, 0])), items)
+        self.assertEqual(list(iter_world(pathlib.Path(self.world) / "none")),
+                         [])
+
+    def test_options(self):
+        for (x, z, chunk), (_, _, expected) in zip(
+                parse_region(self.path, threads=2, arrays="memoryview",
+                             lazy=True), self.expected):
+            self.assertEqual(chunk["xPos"], x)
+            self.assertEqual(chunk["heights"].tolist(), expected["heights"])
+            self.assertEqual(chunk["entities"], expected["entities"])
+        with self.assertRaisesRegex(ValueError, "varint"):
+            parse_region(self.path, varint=True)
+
+    def test_corrupt_chunk(self):
+        path = self.write("region/r.2.0.mca", region_file({
+            (0, 0): (2, zlib.compress(self.docs[0, 0])),
+            (1, 0): (2, zlib.compress(self.docs[0, 0])[:-8]),
+            (2, 0): (4, b"lz4"),
+        }))
+        with self.assertRaisesRegex(ValueError, r"Chunk \(1, 0\)"):
+            parse_region(path, threads=2)
+        with self.assertRaisesRegex(ValueError, "r.2.0.mca"):
+            list(iter_world(self.world, threads=2))
+        with self.assertRaisesRegex(ValueError, "truncated"):
+            parse_region(self.write("region/r.3.0.mca", b"\0" * 10))
+
+    def test_abandoned(self):
+        chunks = iter_region(self.path, threads=2)
+        self.assertEqual(len(next(chunks)), 3)
+        del chunks
+        self.assertEqual(parse_region(self.path, threads=2), self.expected)
+
+
+if __name__ == "__main__":
+    unittest.main()